@@ -0,0 +1,318 @@
+/*
+ * Binder transaction stress test
+ *
+ * Starts a context manager with one looper thread per client and forks
+ * a number of client processes that send synchronous transactions to
+ * handle 0 as fast as they can.  Prints the aggregate transaction rate,
+ * which shows how well concurrent transactions scale in the driver.
+ *
+ * Build from the top of the kernel tree with:
+ *
+ *	gcc -O2 -Wall -I drivers/staging/android -pthread \
+ *		-o binder-stress Documentation/android/binder-stress.c
+ *
+ * and run as a user that may open /dev/binder and become the context
+ * manager (no other servicemanager may be running):
+ *
+ *	binder-stress [-c clients] [-s payload bytes] [-t seconds]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define MAP_SIZE	(128 * 1024)
+
+static int nr_clients = 4;
+static size_t payload = 64;
+static int seconds = 5;
+
+struct binder_conn {
+	int fd;
+	void *map;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void conn_open(struct binder_conn *conn)
+{
+	struct binder_version vers;
+
+	conn->fd = open("/dev/binder", O_RDWR);
+	if (conn->fd < 0)
+		die("open /dev/binder");
+	if (ioctl(conn->fd, BINDER_VERSION, &vers) < 0)
+		die("BINDER_VERSION");
+	if (vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol %ld, expected %d\n",
+			vers.protocol_version, BINDER_CURRENT_PROTOCOL_VERSION);
+		exit(1);
+	}
+	conn->map = mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, conn->fd, 0);
+	if (conn->map == MAP_FAILED)
+		die("mmap /dev/binder");
+}
+
+/* Commands are a 32-bit code followed by an unaligned payload. */
+static size_t put_cmd(uint8_t *buf, size_t pos, uint32_t cmd,
+		      const void *arg, size_t len)
+{
+	memcpy(buf + pos, &cmd, sizeof(cmd));
+	memcpy(buf + pos + sizeof(cmd), arg, len);
+	return pos + sizeof(cmd) + len;
+}
+
+static void write_read(struct binder_conn *conn, void *wbuf, size_t wsize,
+		       void *rbuf, size_t rsize, size_t *consumed)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.write_size = wsize;
+	bwr.read_buffer = (unsigned long)rbuf;
+	bwr.read_size = rsize;
+	while (ioctl(conn->fd, BINDER_WRITE_READ, &bwr) < 0) {
+		if (errno != EINTR)
+			die("BINDER_WRITE_READ");
+		/* Do not resend what the driver already consumed. */
+		bwr.write_buffer += bwr.write_consumed;
+		bwr.write_size -= bwr.write_consumed;
+		bwr.write_consumed = 0;
+	}
+	if (consumed)
+		*consumed = bwr.read_consumed;
+}
+
+/*
+ * Walks the returned commands and calls back for the transaction data of
+ * BR_TRANSACTION and BR_REPLY.  Returns nonzero once a reply was seen.
+ */
+static int parse(uint8_t *buf, size_t size,
+		 void (*fn)(uint32_t cmd, struct binder_transaction_data *tr,
+			    void *arg), void *arg)
+{
+	struct binder_transaction_data tr;
+	size_t pos = 0;
+	uint32_t cmd;
+	int replied = 0;
+
+	while (pos + sizeof(cmd) <= size) {
+		memcpy(&cmd, buf + pos, sizeof(cmd));
+		pos += sizeof(cmd);
+		switch (cmd) {
+		case BR_TRANSACTION:
+		case BR_REPLY:
+			memcpy(&tr, buf + pos, sizeof(tr));
+			fn(cmd, &tr, arg);
+			if (cmd == BR_REPLY)
+				replied = 1;
+			break;
+		case BR_DEAD_REPLY:
+		case BR_FAILED_REPLY:
+			fprintf(stderr, "transaction failed (%s)\n",
+				cmd == BR_DEAD_REPLY ? "dead" : "failed");
+			exit(1);
+		}
+		pos += _IOC_SIZE(cmd);
+	}
+	return replied;
+}
+
+static void server_reply(uint32_t cmd, struct binder_transaction_data *tr,
+			 void *arg)
+{
+	struct binder_conn *conn = arg;
+	struct binder_transaction_data reply;
+	uint8_t wbuf[128];
+	int32_t status = 0;
+	size_t pos;
+
+	if (cmd != BR_TRANSACTION)
+		return;
+	pos = put_cmd(wbuf, 0, BC_FREE_BUFFER, &tr->data.ptr.buffer,
+		      sizeof(tr->data.ptr.buffer));
+	memset(&reply, 0, sizeof(reply));
+	reply.flags = TF_STATUS_CODE;
+	reply.data_size = sizeof(status);
+	reply.data.ptr.buffer = &status;
+	pos = put_cmd(wbuf, pos, BC_REPLY, &reply, sizeof(reply));
+	write_read(conn, wbuf, pos, NULL, 0, NULL);
+}
+
+static void *server_looper(void *arg)
+{
+	struct binder_conn *conn = arg;
+	uint8_t wbuf[8], rbuf[256];
+	size_t pos, consumed;
+
+	pos = put_cmd(wbuf, 0, BC_ENTER_LOOPER, NULL, 0);
+	write_read(conn, wbuf, pos, NULL, 0, NULL);
+	for (;;) {
+		write_read(conn, NULL, 0, rbuf, sizeof(rbuf), &consumed);
+		parse(rbuf, consumed, server_reply, conn);
+	}
+	return NULL;
+}
+
+static void server(int ready_fd)
+{
+	struct binder_conn conn;
+	pthread_t thread;
+	int i;
+
+	conn_open(&conn);
+	if (ioctl(conn.fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR");
+	for (i = 1; i < nr_clients; i++)
+		if (pthread_create(&thread, NULL, server_looper, &conn))
+			die("pthread_create");
+	if (write(ready_fd, "", 1) != 1)
+		die("write");
+	close(ready_fd);
+	server_looper(&conn);
+}
+
+static void client_free(uint32_t cmd, struct binder_transaction_data *tr,
+			void *arg)
+{
+	struct binder_conn *conn = arg;
+	uint8_t wbuf[32];
+	size_t pos;
+
+	pos = put_cmd(wbuf, 0, BC_FREE_BUFFER, &tr->data.ptr.buffer,
+		      sizeof(tr->data.ptr.buffer));
+	write_read(conn, wbuf, pos, NULL, 0, NULL);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void client(int result_fd)
+{
+	struct binder_conn conn;
+	struct binder_transaction_data tr;
+	uint8_t wbuf[128], rbuf[256];
+	unsigned long count = 0;
+	size_t pos, consumed;
+	double end;
+	void *data;
+
+	conn_open(&conn);
+	data = calloc(1, payload ? payload : 1);
+	if (!data)
+		die("calloc");
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = 0;
+	tr.code = 1;
+	tr.data_size = payload;
+	tr.data.ptr.buffer = data;
+	pos = put_cmd(wbuf, 0, BC_TRANSACTION, &tr, sizeof(tr));
+
+	end = now() + seconds;
+	while (now() < end) {
+		write_read(&conn, wbuf, pos, rbuf, sizeof(rbuf), &consumed);
+		while (!parse(rbuf, consumed, client_free, &conn))
+			write_read(&conn, NULL, 0, rbuf, sizeof(rbuf),
+				   &consumed);
+		count++;
+	}
+	if (write(result_fd, &count, sizeof(count)) != sizeof(count))
+		die("write");
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	int ready[2], result[2];
+	unsigned long count, total = 0;
+	pid_t server_pid;
+	char c;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "c:s:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			nr_clients = atoi(optarg);
+			break;
+		case 's':
+			payload = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c clients] "
+				"[-s payload bytes] [-t seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nr_clients < 1 || seconds < 1) {
+		fprintf(stderr, "need at least one client and one second\n");
+		return 1;
+	}
+
+	if (pipe(ready) || pipe(result))
+		die("pipe");
+	server_pid = fork();
+	if (server_pid < 0)
+		die("fork");
+	if (!server_pid) {
+		close(ready[0]);
+		server(ready[1]);
+	}
+	close(ready[1]);
+	if (read(ready[0], &c, 1) != 1) {
+		fprintf(stderr, "server failed to start\n");
+		return 1;
+	}
+
+	for (i = 0; i < nr_clients; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			die("fork");
+		if (!pid)
+			client(result[1]);
+	}
+	close(result[1]);
+
+	for (i = 0; i < nr_clients; i++) {
+		if (read(result[0], &count, sizeof(count)) != sizeof(count)) {
+			fprintf(stderr, "client %d did not report\n", i);
+			break;
+		}
+		total += count;
+	}
+	kill(server_pid, SIGTERM);
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+
+	printf("%d clients, %zu byte payload: %lu transactions in %d s, "
+	       "%.0f/s\n", nr_clients, payload, total, seconds,
+	       (double)total / seconds);
+	return 0;
+}
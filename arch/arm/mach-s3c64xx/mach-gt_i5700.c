@@ -26,6 +26,7 @@
 #include <linux/regulator/machine.h>
 #include <linux/regulator/max8698.h>
 #include <linux/android_pmem.h>
+#include <linux/memblock.h>
 #include <linux/reboot.h>
 #include <linux/spi/spi.h>
 #include <linux/spi/spi_gpio.h>
@@ -582,6 +583,7 @@ static struct android_pmem_platform_data pmem_pdata = {
 	.no_allocator	= 1,
 	.cached		= 1,
 	.buffered	= 1,
+	.lend		= 1,
 	.start		= RESERVED_PMEM_START,
 	.size		= RESERVED_PMEM,
 };
@@ -1483,7 +1485,20 @@ static void __init spica_fixup(struct machine_desc *desc,
 
 	mi->bank[1].start = PHYS_OFFSET + SZ_128M;
 	mi->bank[1].size = PHYS_UNRESERVED_SIZE - SZ_128M;
+#ifdef CONFIG_ANDROID_PMEM_LEND
+	/* The general pmem region, right above, is lent to the page
+	 * allocator while unused, so it needs to be in the memory map.
+	 * The other regions all share memory with G3D and stay out. */
+	mi->bank[1].size += RESERVED_PMEM;
+#endif
+}
+
+#ifdef CONFIG_ANDROID_PMEM_LEND
+static void __init spica_reserve(void)
+{
+	memblock_reserve(RESERVED_PMEM_START, RESERVED_PMEM);
 }
+#endif
 
 static void __init spica_map_io(void)
 {
@@ -1543,6 +1558,9 @@ MACHINE_START(GT_I5700, "Spica")
 	.boot_params	= S3C64XX_PA_SDRAM + 0x100,
 	.init_irq	= s3c6410_init_irq,
 	.fixup		= spica_fixup,
+#ifdef CONFIG_ANDROID_PMEM_LEND
+	.reserve	= spica_reserve,
+#endif
 	.map_io		= spica_map_io,
 	.init_machine	= spica_machine_init,
 	.timer		= &s3c64xx_timer,
@@ -19,7 +19,9 @@
 #include <linux/cpu.h>
 #include <linux/cpumask.h>
 #include <linux/cpufreq.h>
+#include <linux/input.h>
 #include <linux/mutex.h>
+#include <linux/slab.h>
 #include <linux/sched.h>
 #include <linux/tick.h>
 #include <linux/timer.h>
@@ -40,6 +42,7 @@ struct cpufreq_interactive_cpuinfo {
 	int idling;
 	u64 freq_change_time;
 	u64 freq_change_time_in_idle;
+	u64 hispeed_validate_time;
 	struct cpufreq_policy *policy;
 	struct cpufreq_frequency_table *freq_table;
 	unsigned int target_freq;
@@ -57,16 +60,48 @@ static spinlock_t up_cpumask_lock;
 static cpumask_t down_cpumask;
 static spinlock_t down_cpumask_lock;
 
-/* Go to max speed when CPU load at or above this value. */
+/* Go to hispeed_freq when CPU load at or above this value. */
 #define DEFAULT_GO_MAXSPEED_LOAD 85
 static unsigned long go_maxspeed_load;
 
+/*
+ * Target load per frequency: "load freq:load freq:load ..." means load
+ * below the first freq, the next load from that freq up, and so on.
+ * The lowest frequency that brings the load under its target is chosen.
+ */
+#define DEFAULT_TARGET_LOAD 90
+static unsigned int default_target_loads[] = {DEFAULT_TARGET_LOAD};
+static unsigned int *target_loads = default_target_loads;
+static int ntarget_loads = ARRAY_SIZE(default_target_loads);
+static DEFINE_SPINLOCK(target_loads_lock);
+
+/*
+ * Once at or above hispeed_freq, wait this long (usecs) at a speed before
+ * stepping up further.
+ */
+#define DEFAULT_ABOVE_HISPEED_DELAY 20000
+static unsigned long above_hispeed_delay;
+
 /*
  * The minimum amount of time to spend at a frequency before we can ramp down.
  */
 #define DEFAULT_MIN_SAMPLE_TIME 80000;
 static unsigned long min_sample_time;
 
+/*
+ * Frequency to boost to on touch and key input, 0 for the policy maximum.
+ */
+static unsigned long hispeed_freq;
+
+/*
+ * Whether input events boost the frequency, and for how long (usecs).
+ */
+#define DEFAULT_INPUT_BOOST_TIME 80000
+static unsigned long input_boost = 1;
+static unsigned long input_boost_time;
+static unsigned long input_boost_end;
+static int input_handler_registered;
+
 #define DEBUG 0
 #define BUFSZ 128
 
@@ -90,6 +125,9 @@ static spinlock_t dbgpr_lock;
 
 static u64 up_request_time;
 static unsigned int up_max_latency;
+static int up_request_boost;
+static unsigned int boost_count;
+static unsigned int boost_max_latency;
 
 static void dbgpr(char *fmt, ...)
 {
@@ -144,6 +182,8 @@ static int dbg_proc_read(char *buffer, char **start, off_t offset,
 			       int count, int *peof, void *dat)
 {
 	printk("max up_task latency=%uus\n", up_max_latency);
+	printk("input boosts=%u max boost latency=%uus\n", boost_count,
+	       boost_max_latency);
 	dbgdump();
 	*peof = 1;
 	return 0;
@@ -167,6 +207,77 @@ struct cpufreq_governor cpufreq_gov_interactive = {
 	.owner = THIS_MODULE,
 };
 
+static unsigned int freq_to_targetload(unsigned int freq)
+{
+	int i;
+	unsigned int ret;
+	unsigned long flags;
+
+	spin_lock_irqsave(&target_loads_lock, flags);
+	for (i = 0; i < ntarget_loads - 1 && freq >= target_loads[i + 1];
+	     i += 2)
+		;
+	ret = target_loads[i];
+	spin_unlock_irqrestore(&target_loads_lock, flags);
+	return ret;
+}
+
+/*
+ * Find the lowest table frequency at which loadadjfreq (load in percent
+ * times the frequency it was measured at) stays within the target load of
+ * that frequency. As target loads differ per frequency this may have to
+ * bounce between neighbours; freqmin and freqmax bracket the answer.
+ */
+static unsigned int choose_freq(struct cpufreq_interactive_cpuinfo *pcpu,
+				unsigned int loadadjfreq)
+{
+	unsigned int freq = pcpu->policy->cur;
+	unsigned int prevfreq, freqmin = 0, freqmax = UINT_MAX;
+	unsigned int index;
+
+	do {
+		prevfreq = freq;
+		if (cpufreq_frequency_table_target(pcpu->policy,
+				pcpu->freq_table,
+				loadadjfreq / freq_to_targetload(freq),
+				CPUFREQ_RELATION_L, &index))
+			break;
+		freq = pcpu->freq_table[index].frequency;
+
+		if (freq > prevfreq) {
+			/* prevfreq is too low */
+			freqmin = prevfreq;
+			if (freq >= freqmax) {
+				/* try the highest freq below freqmax */
+				if (cpufreq_frequency_table_target(pcpu->policy,
+						pcpu->freq_table, freqmax - 1,
+						CPUFREQ_RELATION_H, &index))
+					break;
+				freq = pcpu->freq_table[index].frequency;
+				if (freq == freqmin) {
+					freq = freqmax;
+					break;
+				}
+			}
+		} else if (freq < prevfreq) {
+			/* prevfreq might be higher than needed */
+			freqmax = prevfreq;
+			if (freq <= freqmin) {
+				/* try the lowest freq above freqmin */
+				if (cpufreq_frequency_table_target(pcpu->policy,
+						pcpu->freq_table, freqmin + 1,
+						CPUFREQ_RELATION_L, &index))
+					break;
+				freq = pcpu->freq_table[index].frequency;
+				if (freq == freqmax)
+					break;
+			}
+		}
+	} while (freq != prevfreq);
+
+	return freq;
+}
+
 static void cpufreq_interactive_timer(unsigned long data)
 {
 	unsigned int delta_idle;
@@ -179,6 +290,7 @@ static void cpufreq_interactive_timer(unsigned long data)
 		&per_cpu(cpuinfo, data);
 	u64 now_idle;
 	unsigned int new_freq;
+	unsigned int hispeed;
 	unsigned int index;
 	unsigned long flags;
 
@@ -250,10 +362,34 @@ static void cpufreq_interactive_timer(unsigned long data)
 	if (load_since_change > cpu_load)
 		cpu_load = load_since_change;
 
-	if (cpu_load >= go_maxspeed_load)
-		new_freq = pcpu->policy->max;
-	else
-		new_freq = pcpu->policy->max * cpu_load / 100;
+	hispeed = hispeed_freq ? : pcpu->policy->max;
+
+	if (cpu_load >= go_maxspeed_load) {
+		if (pcpu->target_freq < hispeed)
+			new_freq = hispeed;
+		else
+			new_freq = max(choose_freq(pcpu,
+					cpu_load * pcpu->policy->cur), hispeed);
+	} else {
+		new_freq = choose_freq(pcpu, cpu_load * pcpu->policy->cur);
+	}
+
+	if (time_before(jiffies, input_boost_end) && new_freq < hispeed)
+		new_freq = hispeed;
+
+	/*
+	 * Above hispeed_freq, step up only after above_hispeed_delay at the
+	 * current speed.
+	 */
+	if (pcpu->target_freq >= hispeed && new_freq > pcpu->target_freq &&
+	    cputime64_sub(pcpu->timer_run_time, pcpu->hispeed_validate_time) <
+	    above_hispeed_delay) {
+		dbgpr("timer %d: load=%d cur=%d tgt=%d hispeed delay\n",
+		      (int) data, cpu_load, pcpu->target_freq, new_freq);
+		goto rearm;
+	}
+
+	pcpu->hispeed_validate_time = pcpu->timer_run_time;
 
 	if (cpufreq_frequency_table_target(pcpu->policy, pcpu->freq_table,
 					   new_freq, CPUFREQ_RELATION_H,
@@ -464,7 +600,10 @@ static int cpufreq_interactive_up_task(void *data)
 
 			if (lat > up_max_latency)
 				up_max_latency = lat;
+			if (up_request_boost && lat > boost_max_latency)
+				boost_max_latency = lat;
 		}
+		up_request_boost = 0;
 #endif
 
 		tmp_mask = up_cpumask;
@@ -527,6 +666,144 @@ static void cpufreq_interactive_freq_down(struct work_struct *work)
 	}
 }
 
+/*
+ * Called from the input event path with interrupts off: raise every CPU
+ * below the boost frequency straight through up_task, skipping the timer.
+ */
+static void cpufreq_interactive_boost(void)
+{
+	unsigned int cpu;
+	unsigned int index;
+	unsigned long flags;
+	int wake = 0;
+	struct cpufreq_interactive_cpuinfo *pcpu;
+
+	input_boost_end = jiffies + usecs_to_jiffies(input_boost_time);
+
+	for_each_online_cpu(cpu) {
+		pcpu = &per_cpu(cpuinfo, cpu);
+		smp_rmb();
+
+		if (!pcpu->governor_enabled)
+			continue;
+
+		if (cpufreq_frequency_table_target(pcpu->policy,
+				pcpu->freq_table,
+				hispeed_freq ? : pcpu->policy->max,
+				CPUFREQ_RELATION_H, &index))
+			continue;
+
+		if (pcpu->target_freq >= pcpu->freq_table[index].frequency)
+			continue;
+
+		pcpu->target_freq = pcpu->freq_table[index].frequency;
+		pcpu->hispeed_validate_time = ktime_to_us(ktime_get());
+		spin_lock_irqsave(&up_cpumask_lock, flags);
+		cpumask_set_cpu(cpu, &up_cpumask);
+		spin_unlock_irqrestore(&up_cpumask_lock, flags);
+		wake = 1;
+		dbgpr("boost %d: tgt=%d\n", cpu, pcpu->target_freq);
+	}
+
+	if (wake) {
+#if DEBUG
+		boost_count++;
+		up_request_boost = 1;
+		up_request_time = ktime_to_us(ktime_get());
+#endif
+		wake_up_process(up_task);
+	}
+}
+
+static void cpufreq_interactive_input_event(struct input_handle *handle,
+		unsigned int type, unsigned int code, int value)
+{
+	if (!input_boost)
+		return;
+
+	/*
+	 * Touchscreens boost once per report.  Everything else boosts when a
+	 * key goes down; releases and autorepeat are ignored.
+	 */
+	if ((type == EV_SYN && code == SYN_REPORT && handle->private) ||
+	    (type == EV_KEY && value == 1))
+		cpufreq_interactive_boost();
+}
+
+static int cpufreq_interactive_input_connect(struct input_handler *handler,
+		struct input_dev *dev, const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int error;
+
+	handle = kzalloc(sizeof(struct input_handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "cpufreq_interactive";
+	handle->private = (void *)id->driver_info;
+
+	error = input_register_handle(handle);
+	if (error)
+		goto err_free;
+
+	error = input_open_device(handle);
+	if (error)
+		goto err_unregister;
+
+	return 0;
+
+err_unregister:
+	input_unregister_handle(handle);
+err_free:
+	kfree(handle);
+	return error;
+}
+
+static void cpufreq_interactive_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id cpufreq_interactive_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_MT_POSITION_X)] =
+			    BIT_MASK(ABS_MT_POSITION_X) },
+		.driver_info = 1,
+	},
+	{
+		/* single touch: sensors report ABS_X too, so want BTN_TOUCH */
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_KEYBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_KEY) | BIT_MASK(EV_ABS) },
+		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
+		.absbit = { [BIT_WORD(ABS_X)] = BIT_MASK(ABS_X) },
+		.driver_info = 1,
+	},
+	{
+		/* keys and buttons; touchscreens matched above already */
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{ },
+};
+
+static struct input_handler cpufreq_interactive_input_handler = {
+	.event		= cpufreq_interactive_input_event,
+	.connect	= cpufreq_interactive_input_connect,
+	.disconnect	= cpufreq_interactive_input_disconnect,
+	.name		= "cpufreq_interactive",
+	.id_table	= cpufreq_interactive_ids,
+};
+
 static ssize_t show_go_maxspeed_load(struct kobject *kobj,
 				     struct attribute *attr, char *buf)
 {
@@ -557,9 +834,145 @@ static ssize_t store_min_sample_time(struct kobject *kobj,
 static struct global_attr min_sample_time_attr = __ATTR(min_sample_time, 0644,
 		show_min_sample_time, store_min_sample_time);
 
+static ssize_t show_hispeed_freq(struct kobject *kobj,
+				 struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", hispeed_freq);
+}
+
+static ssize_t store_hispeed_freq(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret = strict_strtoul(buf, 0, &hispeed_freq);
+
+	return ret ? ret : count;
+}
+
+static struct global_attr hispeed_freq_attr = __ATTR(hispeed_freq, 0644,
+		show_hispeed_freq, store_hispeed_freq);
+
+static ssize_t show_input_boost(struct kobject *kobj,
+				struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", input_boost);
+}
+
+static ssize_t store_input_boost(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret = strict_strtoul(buf, 0, &input_boost);
+
+	return ret ? ret : count;
+}
+
+static struct global_attr input_boost_attr = __ATTR(input_boost, 0644,
+		show_input_boost, store_input_boost);
+
+static ssize_t show_input_boost_time(struct kobject *kobj,
+				     struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", input_boost_time);
+}
+
+static ssize_t store_input_boost_time(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret = strict_strtoul(buf, 0, &input_boost_time);
+
+	return ret ? ret : count;
+}
+
+static struct global_attr input_boost_time_attr = __ATTR(input_boost_time,
+		0644, show_input_boost_time, store_input_boost_time);
+
+static ssize_t show_target_loads(struct kobject *kobj,
+				 struct attribute *attr, char *buf)
+{
+	int i;
+	ssize_t ret = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&target_loads_lock, flags);
+	for (i = 0; i < ntarget_loads; i++)
+		ret += sprintf(buf + ret, "%u%s", target_loads[i],
+			       i & 1 ? ":" : " ");
+	spin_unlock_irqrestore(&target_loads_lock, flags);
+	buf[ret - 1] = '\n';
+	return ret;
+}
+
+static ssize_t store_target_loads(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	const char *cp;
+	unsigned int *new_loads, *old_loads;
+	int ntokens = 1;
+	int i;
+	unsigned long flags;
+
+	for (cp = buf; (cp = strpbrk(cp, " :")); cp++)
+		ntokens++;
+	if (!(ntokens & 1))
+		return -EINVAL;
+
+	new_loads = kmalloc(ntokens * sizeof(unsigned int), GFP_KERNEL);
+	if (!new_loads)
+		return -ENOMEM;
+
+	for (cp = buf, i = 0; i < ntokens; i++) {
+		if (sscanf(cp, "%u", &new_loads[i]) != 1 ||
+		    (!(i & 1) && (!new_loads[i] || new_loads[i] > 100)))
+			goto err_inval;
+		cp = strpbrk(cp, " :");
+		if (cp)
+			cp++;
+		else if (i != ntokens - 1)
+			goto err_inval;
+	}
+
+	spin_lock_irqsave(&target_loads_lock, flags);
+	old_loads = target_loads;
+	target_loads = new_loads;
+	ntarget_loads = ntokens;
+	spin_unlock_irqrestore(&target_loads_lock, flags);
+	if (old_loads != default_target_loads)
+		kfree(old_loads);
+	return count;
+
+err_inval:
+	kfree(new_loads);
+	return -EINVAL;
+}
+
+static struct global_attr target_loads_attr = __ATTR(target_loads, 0644,
+		show_target_loads, store_target_loads);
+
+static ssize_t show_above_hispeed_delay(struct kobject *kobj,
+					struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", above_hispeed_delay);
+}
+
+static ssize_t store_above_hispeed_delay(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret = strict_strtoul(buf, 0, &above_hispeed_delay);
+
+	return ret ? ret : count;
+}
+
+static struct global_attr above_hispeed_delay_attr =
+	__ATTR(above_hispeed_delay, 0644,
+	       show_above_hispeed_delay, store_above_hispeed_delay);
+
 static struct attribute *interactive_attributes[] = {
 	&go_maxspeed_load_attr.attr,
 	&min_sample_time_attr.attr,
+	&hispeed_freq_attr.attr,
+	&input_boost_attr.attr,
+	&input_boost_time_attr.attr,
+	&target_loads_attr.attr,
+	&above_hispeed_delay_attr.attr,
 	NULL,
 };
 
@@ -586,6 +999,7 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *new_policy,
 		pcpu->freq_change_time_in_idle =
 			get_cpu_idle_time_us(new_policy->cpu,
 					     &pcpu->freq_change_time);
+		pcpu->hispeed_validate_time = pcpu->freq_change_time;
 		pcpu->governor_enabled = 1;
 		smp_wmb();
 		/*
@@ -600,6 +1014,12 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *new_policy,
 		if (rc)
 			return rc;
 
+		rc = input_register_handler(&cpufreq_interactive_input_handler);
+		if (rc)
+			pr_warn("%s: failed to register input handler, "
+				"no input boost\n", __func__);
+		input_handler_registered = !rc;
+
 		pm_idle_old = pm_idle;
 		pm_idle = cpufreq_interactive_idle;
 		break;
@@ -620,6 +1040,11 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *new_policy,
 		if (atomic_dec_return(&active_count) > 0)
 			return 0;
 
+		if (input_handler_registered)
+			input_unregister_handler(
+				&cpufreq_interactive_input_handler);
+		input_handler_registered = 0;
+
 		sysfs_remove_group(cpufreq_global_kobject,
 				&interactive_attr_group);
 
@@ -646,6 +1071,9 @@ static int __init cpufreq_interactive_init(void)
 
 	go_maxspeed_load = DEFAULT_GO_MAXSPEED_LOAD;
 	min_sample_time = DEFAULT_MIN_SAMPLE_TIME;
+	input_boost_time = DEFAULT_INPUT_BOOST_TIME;
+	above_hispeed_delay = DEFAULT_ABOVE_HISPEED_DELAY;
+	input_boost_end = jiffies;
 
 	/* Initalize per-cpu timers */
 	for_each_possible_cpu(i) {
@@ -701,6 +1129,8 @@ static void __exit cpufreq_interactive_exit(void)
 	kthread_stop(up_task);
 	put_task_struct(up_task);
 	destroy_workqueue(down_wq);
+	if (target_loads != default_target_loads)
+		kfree(target_loads);
 }
 
 module_exit(cpufreq_interactive_exit);
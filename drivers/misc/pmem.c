@@ -24,6 +24,9 @@
 #include <linux/android_pmem.h>
 #include <linux/mempolicy.h>
 #include <linux/sched.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/page-isolation.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
 #include <asm/cacheflush.h>
@@ -31,6 +34,8 @@
 #define PMEM_MAX_DEVICES 10
 #define PMEM_MAX_ORDER 128
 #define PMEM_MIN_ALLOC PAGE_SIZE
+/* how long a lendable region has to be unused before it is lent */
+#define PMEM_LEND_DELAY (5 * HZ)
 
 #define PMEM_DEBUG 1
 
@@ -49,6 +54,9 @@
  */
 #define PMEM_FLAGS_SUBMAP 0x1 << 3
 #define PMEM_FLAGS_UNSUBMAP 0x1 << 4
+/* indicates the physical address of the allocation has been handed out
+ * (or other files are connected to it), so it can't be moved */
+#define PMEM_FLAGS_PINNED 0x1 << 5
 
 
 struct pmem_data {
@@ -63,6 +71,8 @@ struct pmem_data {
 	struct rw_semaphore sem;
 	/* info about the mmaping process */
 	struct vm_area_struct *vma;
+	/* number of vmas mapping this file, allocations with none can move */
+	int map_count;
 	/* task struct of the mapping process */
 	struct task_struct *task;
 	/* process id of teh mapping process */
@@ -146,6 +156,25 @@ struct pmem_info {
 	 */
 	struct rw_semaphore bitmap_sem;
 
+	/* number of allocations, protected by bitmap_sem like everything
+	 * below */
+	int nr_allocated;
+	/* the region is given to the page allocator while nr_allocated is 0,
+	 * lent is set while it is */
+	unsigned lend;
+	unsigned lent;
+	struct delayed_work lend_work;
+
+	/* counters for the stats file in debugfs */
+	unsigned long alloc_count;
+	unsigned long alloc_fail;
+	unsigned long compact_count;
+	unsigned long compact_moved;
+	unsigned long lend_count;
+	unsigned long reclaim_count;
+	unsigned long reclaim_fail;
+	unsigned long reclaim_us_max;
+
 	long (*ioctl)(struct file *, unsigned int, unsigned long);
 	int (*release)(struct inode *, struct file *);
 };
@@ -233,12 +262,91 @@ static int is_master_owner(struct file *file)
 	return ret;
 }
 
+#ifdef CONFIG_ANDROID_PMEM_LEND
+static int pmem_can_lend(int id)
+{
+	unsigned long align = pageblock_nr_pages << PAGE_SHIFT;
+	unsigned long pfn = pmem[id].base >> PAGE_SHIFT;
+	unsigned long end_pfn = pfn + (pmem[id].size >> PAGE_SHIFT);
+
+	if (!pmem[id].size || (pmem[id].base & (align - 1)) ||
+	    (pmem[id].size & (align - 1)) ||
+	    !pfn_valid(pfn) || !pfn_valid(end_pfn - 1) ||
+	    PageHighMem(pfn_to_page(end_pfn - 1)) ||
+	    page_zone(pfn_to_page(pfn)) != page_zone(pfn_to_page(end_pfn - 1))) {
+		printk(KERN_WARNING "pmem: %s can't be lent, it must be "
+		       "pageblock aligned lowmem\n", pmem[id].dev.name);
+		return 0;
+	}
+	return 1;
+}
+
+static void pmem_lend_work(struct work_struct *work)
+{
+	struct pmem_info *info = container_of(work, struct pmem_info,
+					      lend_work.work);
+	unsigned long pfn = info->base >> PAGE_SHIFT;
+
+	down_write(&info->bitmap_sem);
+	if (!info->lent && !info->nr_allocated) {
+		DLOG("lending %s\n", info->dev.name);
+		lend_contig_range(pfn, pfn + (info->size >> PAGE_SHIFT));
+		info->lent = 1;
+		info->lend_count++;
+	}
+	up_write(&info->bitmap_sem);
+}
+
+static void pmem_lend_later(int id)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	if (pmem[id].lend && !pmem[id].lent && !pmem[id].nr_allocated)
+		schedule_delayed_work(&pmem[id].lend_work, PMEM_LEND_DELAY);
+}
+
+static int pmem_reclaim(int id)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	unsigned long pfn = pmem[id].base >> PAGE_SHIFT;
+	ktime_t start;
+	s64 us;
+	int ret;
+
+	if (!pmem[id].lent)
+		return 0;
+
+	start = ktime_get();
+	ret = reclaim_contig_range(pfn, pfn + (pmem[id].size >> PAGE_SHIFT));
+	if (ret) {
+		printk(KERN_WARNING "pmem: %s: lent memory is in use and could "
+		       "not be migrated\n", pmem[id].dev.name);
+		pmem[id].reclaim_fail++;
+		return ret;
+	}
+	/* don't hand out whatever the page allocator left behind */
+	memset(pmem[id].vbase, 0, pmem[id].size);
+	dmac_flush_range(pmem[id].vbase, pmem[id].vbase + pmem[id].size);
+	pmem[id].lent = 0;
+	pmem[id].reclaim_count++;
+	us = ktime_us_delta(ktime_get(), start);
+	if (us > pmem[id].reclaim_us_max)
+		pmem[id].reclaim_us_max = us;
+	return 0;
+}
+#else
+static inline void pmem_lend_later(int id) { }
+static inline int pmem_reclaim(int id) { return 0; }
+#endif
+
 static int pmem_free(int id, int index)
 {
 	/* caller should hold the write lock on pmem_sem! */
 	int buddy, curr = index;
 	DLOG("index %d\n", index);
 
+	pmem[id].nr_allocated--;
+	pmem_lend_later(id);
+
 	if (pmem[id].no_allocator) {
 		pmem[id].allocated = 0;
 		return 0;
@@ -350,6 +458,7 @@ static int pmem_open(struct inode *inode, struct file *file)
 	data->index = -1;
 	data->task = NULL;
 	data->vma = NULL;
+	data->map_count = 0;
 	data->pid = 0;
 	data->master_file = NULL;
 #if PMEM_DEBUG
@@ -379,26 +488,12 @@ static unsigned long pmem_order(unsigned long len)
 	return i;
 }
 
-static int pmem_allocate(int id, unsigned long len)
+static int pmem_alloc_order(int id, unsigned long order, int end)
 {
 	/* caller should hold the write lock on pmem_sem! */
-	/* return the corresponding pdata[] entry */
+	/* return the first bitmap index of a free slot below end */
 	int curr = 0;
-	int end = pmem[id].num_entries;
 	int best_fit = -1;
-	unsigned long order = pmem_order(len);
-
-	if (pmem[id].no_allocator) {
-		DLOG("no allocator");
-		if ((len > pmem[id].size) || pmem[id].allocated)
-			return -1;
-		pmem[id].allocated = 1;
-		return len;
-	}
-
-	if (order > PMEM_MAX_ORDER)
-		return -1;
-	DLOG("order %lx\n", order);
 
 	/* look through the bitmap:
 	 * 	if you find a free slot of the correct order use it
@@ -422,10 +517,8 @@ static int pmem_allocate(int id, unsigned long len)
 	/* if best_fit < 0, there are no suitable slots,
 	 * return an error
 	 */
-	if (best_fit < 0) {
-		printk("pmem: no space left to allocate!\n");
+	if (best_fit < 0)
 		return -1;
-	}
 
 	/* now partition the best fit:
 	 * 	split the slot into 2 buddies of order - 1
@@ -441,6 +534,50 @@ static int pmem_allocate(int id, unsigned long len)
 	return best_fit;
 }
 
+static int pmem_compact(int id);
+
+static int pmem_allocate(int id, unsigned long len)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	/* return the corresponding pdata[] entry */
+	unsigned long order = pmem_order(len);
+	int index;
+
+	if (pmem[id].no_allocator) {
+		DLOG("no allocator");
+		if ((len > pmem[id].size) || pmem[id].allocated ||
+		    pmem_reclaim(id)) {
+			pmem[id].alloc_fail++;
+			return -1;
+		}
+		pmem[id].allocated = 1;
+		pmem[id].nr_allocated++;
+		pmem[id].alloc_count++;
+		return len;
+	}
+
+	if (order > PMEM_MAX_ORDER || pmem_reclaim(id)) {
+		pmem[id].alloc_fail++;
+		return -1;
+	}
+	DLOG("order %lx\n", order);
+
+	index = pmem_alloc_order(id, order, pmem[id].num_entries);
+	/* the free space may be too fragmented, try packing it */
+	if (index < 0 && pmem_compact(id))
+		index = pmem_alloc_order(id, order, pmem[id].num_entries);
+	if (index < 0) {
+		printk("pmem: no space left to allocate!\n");
+		pmem[id].alloc_fail++;
+		/* the region may have just been reclaimed for nothing */
+		pmem_lend_later(id);
+		return -1;
+	}
+	pmem[id].nr_allocated++;
+	pmem[id].alloc_count++;
+	return index;
+}
+
 static pgprot_t pmem_access_prot(struct file *file, pgprot_t vma_prot)
 {
 	int id = get_id(file);
@@ -477,6 +614,66 @@ static unsigned long pmem_len(int id, struct pmem_data *data)
 		return PMEM_LEN(id, data->index);
 }
 
+/* move an allocation to the lowest free slot of its order below it, only
+ * allocations nobody maps or knows the physical address of can move */
+static int pmem_move(int id, struct pmem_data *data)
+{
+	/* caller should hold data->sem and the write lock on pmem_sem! */
+	unsigned long len;
+	void *from, *to;
+	int index;
+
+	if (data->index < 0 || data->map_count ||
+	    (data->flags & (PMEM_FLAGS_CONNECTED | PMEM_FLAGS_PINNED)))
+		return 0;
+
+	index = pmem_alloc_order(id, PMEM_ORDER(id, data->index),
+				 data->index);
+	if (index < 0)
+		return 0;
+
+	len = pmem_len(id, data);
+	from = pmem_start_vaddr(id, data);
+	to = (void *)pmem[id].vbase + PMEM_OFFSET(index);
+	DLOG("move %d to %d\n", data->index, index);
+	if (pmem[id].cached)
+		dmac_flush_range(from, from + len);
+	memcpy(to, from, len);
+	if (pmem[id].cached)
+		dmac_flush_range(to, to + len);
+
+	/* the old slot is freed, the allocation itself is still there */
+	pmem[id].nr_allocated++;
+	pmem_free(id, data->index);
+	data->index = index;
+	return 1;
+}
+
+/* pack the movable allocations at the bottom of the region so the free
+ * slots above them coalesce, returns the number of allocations moved */
+static int pmem_compact(int id)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	struct pmem_data *data;
+	int moved = 0;
+
+	/* the caller may hold a data->sem, taking the list lock or other
+	 * data sems could deadlock, skip whatever is busy */
+	if (!mutex_trylock(&pmem[id].data_list_lock))
+		return 0;
+	list_for_each_entry(data, &pmem[id].data_list, list) {
+		if (!down_write_trylock(&data->sem))
+			continue;
+		moved += pmem_move(id, data);
+		up_write(&data->sem);
+	}
+	mutex_unlock(&pmem[id].data_list_lock);
+
+	pmem[id].compact_count++;
+	pmem[id].compact_moved += moved;
+	return moved;
+}
+
 static int pmem_map_garbage(int id, struct vm_area_struct *vma,
 			    struct pmem_data *data, unsigned long offset,
 			    unsigned long len)
@@ -544,6 +741,7 @@ static void pmem_vma_open(struct vm_area_struct *vma)
 	 * ranges via fork */
 	BUG_ON(!has_allocation(file));
 	down_write(&data->sem);
+	data->map_count++;
 	/* remap the garbage pages, forkers don't get access to the data */
 	pmem_unmap_pfn_range(id, vma, data, 0, vma->vm_start - vma->vm_end);
 	up_write(&data->sem);
@@ -563,6 +761,7 @@ static void pmem_vma_close(struct vm_area_struct *vma)
 		return;
 	}
 	down_write(&data->sem);
+	data->map_count--;
 	if (data->vma == vma) {
 		data->vma = NULL;
 		if ((data->flags & PMEM_FLAGS_CONNECTED) &&
@@ -672,6 +871,7 @@ static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
 		data->flags |= PMEM_FLAGS_MASTERMAP;
 		data->pid = current->pid;
 	}
+	data->map_count++;
 	vma->vm_ops = &vm_ops;
 error:
 	up_write(&data->sem);
@@ -724,16 +924,15 @@ int get_pmem_addr(struct file *file, unsigned long *start,
 	}
 	id = get_id(file);
 
-	down_read(&data->sem);
+	down_write(&data->sem);
+	data->flags |= PMEM_FLAGS_PINNED;
 	*start = pmem_start_addr(id, data);
 	*len = pmem_len(id, data);
 	*vstart = (unsigned long)pmem_start_vaddr(id, data);
-	up_read(&data->sem);
 #if PMEM_DEBUG
-	down_write(&data->sem);
 	data->ref++;
-	up_write(&data->sem);
 #endif
+	up_write(&data->sem);
 	return 0;
 }
 
@@ -849,6 +1048,11 @@ static int pmem_connect(unsigned long connect, struct file *file)
 		goto err_bad_file;
 	}
 	src_data = (struct pmem_data *)src_file->private_data;
+	if (src_data != data) {
+		down_write(&src_data->sem);
+		src_data->flags |= PMEM_FLAGS_PINNED;
+		up_write(&src_data->sem);
+	}
 
 	if (has_allocation(file) && (data->index != src_data->index)) {
 		printk("pmem: file is already mapped but doesn't match this"
@@ -1067,8 +1271,11 @@ static void pmem_get_size(struct pmem_region *region, struct file *file)
 		region->len = 0;
 		return;
 	} else {
+		down_write(&data->sem);
+		data->flags |= PMEM_FLAGS_PINNED;
 		region->offset = pmem_start_addr(id, data);
 		region->len = pmem_len(id, data);
+		up_write(&data->sem);
 	}
 	DLOG("offset %lx len %lx\n", region->offset, region->len);
 }
@@ -1089,8 +1296,11 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 				region.len = 0;
 			} else {
 				data = (struct pmem_data *)file->private_data;
+				down_write(&data->sem);
+				data->flags |= PMEM_FLAGS_PINNED;
 				region.offset = pmem_start_addr(id, data);
 				region.len = pmem_len(id, data);
+				up_write(&data->sem);
 			}
 #if 0
 			printk(KERN_INFO "pmem: request for physical address of pmem region "
@@ -1148,7 +1358,12 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			if (has_allocation(file))
 				return -EINVAL;
 			data = (struct pmem_data *)file->private_data;
-			data->index = pmem_allocate(id, arg);
+			down_write(&data->sem);
+			down_write(&pmem[id].bitmap_sem);
+			if (data->index == -1)
+				data->index = pmem_allocate(id, arg);
+			up_write(&pmem[id].bitmap_sem);
+			up_write(&data->sem);
 			break;
 		}
 	case PMEM_CONNECT:
@@ -1223,6 +1438,66 @@ static struct file_operations debug_fops = {
 	.read = debug_read,
 	.open = debug_open,
 };
+
+static ssize_t debug_stats_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	int id = (int)file->private_data;
+	const int debug_bufmax = 1024;
+	static char buffer[1024];
+	unsigned long nr_free[32];
+	unsigned long free = 0, largest = 0;
+	int i, order, n;
+
+	memset(nr_free, 0, sizeof(nr_free));
+	down_read(&pmem[id].bitmap_sem);
+	if (pmem[id].no_allocator) {
+		if (!pmem[id].allocated)
+			free = largest = pmem[id].num_entries;
+	} else {
+		for (i = 0; i < pmem[id].num_entries;
+		     i = PMEM_NEXT_INDEX(id, i)) {
+			if (!PMEM_IS_FREE(id, i))
+				continue;
+			order = PMEM_ORDER(id, i);
+			if (order < ARRAY_SIZE(nr_free))
+				nr_free[order]++;
+			free += 1UL << order;
+			largest = max(largest, 1UL << order);
+		}
+	}
+
+	/* fragmentation is the part of the free space outside the largest
+	 * free slot */
+	n = scnprintf(buffer, debug_bufmax,
+		      "size: %lu kB\nfree: %lu kB\nlargest free: %lu kB\n"
+		      "fragmentation: %lu%%\nfree slots by order:",
+		      pmem[id].size >> 10, (free * PMEM_MIN_ALLOC) >> 10,
+		      (largest * PMEM_MIN_ALLOC) >> 10,
+		      free ? 100 - largest * 100 / free : 0);
+	for (i = 0; i < ARRAY_SIZE(nr_free); i++)
+		if (nr_free[i])
+			n += scnprintf(buffer + n, debug_bufmax - n, " %d:%lu",
+				       i, nr_free[i]);
+	n += scnprintf(buffer + n, debug_bufmax - n,
+		       "\nallocations: %d\nallocated: %lu\nfailed: %lu\n"
+		       "compactions: %lu\nmoved: %lu\n"
+		       "lent: %u\nlends: %lu\nreclaims: %lu\n"
+		       "reclaim failures: %lu\nmax reclaim us: %lu\n",
+		       pmem[id].nr_allocated, pmem[id].alloc_count,
+		       pmem[id].alloc_fail, pmem[id].compact_count,
+		       pmem[id].compact_moved, pmem[id].lent,
+		       pmem[id].lend_count, pmem[id].reclaim_count,
+		       pmem[id].reclaim_fail, pmem[id].reclaim_us_max);
+	up_read(&pmem[id].bitmap_sem);
+
+	return simple_read_from_buffer(buf, count, ppos, buffer, n);
+}
+
+static struct file_operations debug_stats_fops = {
+	.read = debug_stats_read,
+	.open = debug_open,
+};
 #endif
 
 #if 0
@@ -1239,6 +1514,9 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	int err = 0;
 	int i, index = 0;
 	int id = id_count;
+#if PMEM_DEBUG
+	char stats_name[32];
+#endif
 	id_count++;
 
 	pmem[id].no_allocator = pdata->no_allocator;
@@ -1278,7 +1556,16 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 		}
 	}
 
-	if (pmem[id].cached)
+#ifdef CONFIG_ANDROID_PMEM_LEND
+	INIT_DELAYED_WORK(&pmem[id].lend_work, pmem_lend_work);
+	if (pdata->lend)
+		pmem[id].lend = pmem_can_lend(id);
+#endif
+
+	/* lendable regions are ordinary memory, already mapped */
+	if (pmem[id].lend)
+		pmem[id].vbase = (unsigned char __iomem *)__va(pmem[id].base);
+	else if (pmem[id].cached)
 		pmem[id].vbase = ioremap_cached(pmem[id].base,
 						pmem[id].size);
 #ifdef ioremap_ext_buffered
@@ -1299,7 +1586,13 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 #if PMEM_DEBUG
 	debugfs_create_file(pdata->name, S_IFREG | S_IRUGO, NULL, (void *)id,
 			    &debug_fops);
+	snprintf(stats_name, sizeof(stats_name), "%s_stats", pdata->name);
+	debugfs_create_file(stats_name, S_IFREG | S_IRUGO, NULL, (void *)id,
+			    &debug_stats_fops);
 #endif
+	down_write(&pmem[id].bitmap_sem);
+	pmem_lend_later(id);
+	up_write(&pmem[id].bitmap_sem);
 	return 0;
 error_cant_remap:
 	kfree(pmem[id].bitmap);
@@ -1325,6 +1618,9 @@ static int pmem_probe(struct platform_device *pdev)
 static int pmem_remove(struct platform_device *pdev)
 {
 	int id = pdev->id;
+#ifdef CONFIG_ANDROID_PMEM_LEND
+	cancel_delayed_work_sync(&pmem[id].lend_work);
+#endif
 	__free_page(pfn_to_page(pmem[id].garbage_pfn));
 	misc_deregister(&pmem[id].dev);
 	return 0;
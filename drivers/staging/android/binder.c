@@ -36,6 +36,18 @@
 
 #include "binder.h"
 
+/*
+ * binder_lock protects the object graph: procs, threads, nodes, refs,
+ * transaction stacks and todo lists.  The buffer allocator of each proc is
+ * protected by proc->alloc_lock instead, so that allocating and filling a
+ * transaction buffer does not have to hold binder_lock.  alloc_lock nests
+ * inside binder_lock.
+ *
+ * There is no per-proc or per-node locking of the object graph: two
+ * transactions still serialize on binder_lock everywhere except while their
+ * payloads are copied.  Anything that must stay valid across that window is
+ * pinned with proc->tmp_ref or node->tmp_refs.
+ */
 static DEFINE_MUTEX(binder_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 
@@ -105,6 +117,10 @@ module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
+static int binder_latency_stats;
+module_param_named(latency_stats, binder_latency_stats, bool,
+		   S_IWUSR | S_IRUGO);
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -147,7 +163,7 @@ enum binder_stat_types {
 
 struct binder_stats {
 	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	int bc[_IOC_NR(BC_REPLY_SG) + 1];
 	int obj_created[BINDER_STAT_COUNT];
 	int obj_deleted[BINDER_STAT_COUNT];
 };
@@ -198,6 +214,38 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 	return e;
 }
 
+#define BINDER_LATENCY_BUCKETS 32
+
+/*
+ * log2 histograms, bucket i counts values in [2^i, 2^(i+1)), bucket 0 also
+ * counts 0.  total is BC_TRANSACTION to BR_REPLY, queue is from queueing a
+ * transaction to BR_TRANSACTION and size is data plus offsets in bytes.
+ */
+struct binder_latency {
+	int ref;
+	unsigned int total[BINDER_LATENCY_BUCKETS];
+	unsigned int queue[BINDER_LATENCY_BUCKETS];
+	unsigned int size[BINDER_LATENCY_BUCKETS];
+};
+
+static void binder_latency_add(unsigned int *hist, s64 value)
+{
+	int bucket;
+
+	if (value < 0)
+		value = 0;
+	if (value > UINT_MAX)
+		value = UINT_MAX;
+	bucket = fls((unsigned int)value);
+	hist[bucket ? bucket - 1 : 0]++;
+}
+
+static void binder_put_latency(struct binder_latency *latency)
+{
+	if (latency && --latency->ref == 0)
+		kfree(latency);
+}
+
 struct binder_work {
 	struct list_head entry;
 	enum {
@@ -231,7 +279,10 @@ struct binder_node {
 	unsigned has_async_transaction:1;
 	unsigned accept_fds:1;
 	unsigned min_priority:8;
+	unsigned is_deleted:1;
+	int tmp_refs;
 	struct list_head async_todo;
+	struct binder_latency *latency;
 };
 
 struct binder_ref_death {
@@ -258,21 +309,57 @@ struct binder_ref {
 
 struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by addesss */
-	struct rb_node rb_node; /* free entry by size or allocated entry */
-				/* by address */
+	union {
+		struct rb_node rb_node; /* free entry by size or allocated */
+					/* entry by address */
+		struct list_head quick_entry; /* on a quick list */
+	};
 	unsigned free:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
-	unsigned debug_id:29;
+	unsigned quick:1;
+	unsigned debug_id:28;
 
 	struct binder_transaction *transaction;
 
 	struct binder_node *target_node;
 	size_t data_size;
 	size_t offsets_size;
+	size_t extra_buffers_size;
 	uint8_t data[0];
 };
 
+/*
+ * Pages that are no longer used by any buffer stay mapped and are put on
+ * binder_lru_pages, so the next allocation in the same range does not have
+ * to allocate and map them again.  binder_shrink gives them back under
+ * memory pressure.
+ */
+struct binder_lru_page {
+	struct list_head lru;
+	struct page *page_ptr;
+	struct binder_proc *proc;
+};
+
+/*
+ * Buffers of up to BINDER_QUICK_SIZE(BINDER_QUICK_CLASSES - 1) bytes are
+ * rounded up to a power of two size class.  When freed, up to
+ * BINDER_QUICK_DEPTH of them per class are kept on the quick lists of their
+ * proc, still mapped and not merged with their neighbours, so that the next
+ * buffer of that class needs neither the best-fit tree nor the page
+ * allocator.  The quick lists are given back to the tree when it runs out
+ * of space.
+ */
+#define BINDER_QUICK_SHIFT	6
+#define BINDER_QUICK_CLASSES	6
+#define BINDER_QUICK_DEPTH	4
+#define BINDER_QUICK_SIZE(class)	((size_t)1 << (BINDER_QUICK_SHIFT + (class)))
+
+static LIST_HEAD(binder_lru_pages);
+static DEFINE_SPINLOCK(binder_lru_lock);
+static DECLARE_WAIT_QUEUE_HEAD(binder_lru_wait);
+static int binder_lru_count;
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -294,12 +381,17 @@ struct binder_proc {
 	void *buffer;
 	ptrdiff_t user_buffer_offset;
 
+	struct mutex alloc_lock;
 	struct list_head buffers;
 	struct rb_root free_buffers;
 	struct rb_root allocated_buffers;
+	struct list_head quick_buffers[BINDER_QUICK_CLASSES];
+	int quick_count[BINDER_QUICK_CLASSES];
+	unsigned quick_hits;
 	size_t free_async_space;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
+	int lru_pins;		/* binder_shrink users, under binder_lru_lock */
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
@@ -312,6 +404,9 @@ struct binder_proc {
 	int ready_threads;
 	long default_priority;
 	struct dentry *debugfs_entry;
+	struct binder_latency latency;
+	int tmp_ref;
+	int is_dead;
 };
 
 enum {
@@ -355,10 +450,15 @@ struct binder_transaction {
 	long	priority;
 	long	saved_priority;
 	uid_t	sender_euid;
+	struct binder_latency *latency;
+	ktime_t	start_time;
+	ktime_t	queue_time;
 };
 
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
+static void binder_free_proc(struct binder_proc *proc);
+static int binder_flush_quick_buffers(struct binder_proc *proc);
 
 /*
  * copied from get_unused_fd_flags
@@ -525,6 +625,18 @@ static size_t binder_buffer_size(struct binder_proc *proc,
 			struct binder_buffer, entry) - (size_t)buffer->data;
 }
 
+/* The quick list class for buffers of size bytes, -1 if too large */
+static int binder_quick_class(size_t size)
+{
+	int class = 0;
+
+	if (size > BINDER_QUICK_SIZE(BINDER_QUICK_CLASSES - 1))
+		return -1;
+	while (BINDER_QUICK_SIZE(class) < size)
+		class++;
+	return class;
+}
+
 static void binder_insert_free_buffer(struct binder_proc *proc,
 				      struct binder_buffer *new_buffer)
 {
@@ -583,8 +695,8 @@ static void binder_insert_allocated_buffer(struct binder_proc *proc,
 	rb_insert_color(&new_buffer->rb_node, &proc->allocated_buffers);
 }
 
-static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
-						  void __user *user_ptr)
+static struct binder_buffer *__binder_buffer_lookup(struct binder_proc *proc,
+						    void __user *user_ptr)
 {
 	struct rb_node *n = proc->allocated_buffers.rb_node;
 	struct binder_buffer *buffer;
@@ -607,6 +719,36 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
+						  void __user *user_ptr)
+{
+	struct binder_buffer *buffer;
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = __binder_buffer_lookup(proc, user_ptr);
+	mutex_unlock(&proc->alloc_lock);
+	return buffer;
+}
+
+static void binder_lru_add(struct binder_lru_page *page)
+{
+	spin_lock(&binder_lru_lock);
+	BUG_ON(!list_empty(&page->lru));
+	list_add_tail(&page->lru, &binder_lru_pages);
+	binder_lru_count++;
+	spin_unlock(&binder_lru_lock);
+}
+
+static void binder_lru_del(struct binder_lru_page *page)
+{
+	spin_lock(&binder_lru_lock);
+	if (!list_empty(&page->lru)) {
+		list_del_init(&page->lru);
+		binder_lru_count--;
+	}
+	spin_unlock(&binder_lru_lock);
+}
+
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
@@ -614,8 +756,8 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
-	struct mm_struct *mm;
+	struct binder_lru_page *page;
+	struct mm_struct *mm = NULL;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -624,40 +766,43 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
-	if (vma)
-		mm = NULL;
-	else
-		mm = get_task_mm(proc->tsk);
-
-	if (mm) {
-		down_write(&mm->mmap_sem);
-		vma = proc->vma;
-	}
-
 	if (allocate == 0)
 		goto free_range;
 
-	if (vma == NULL) {
-		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
-		       "map pages in userspace, no vma\n", proc->pid);
-		goto err_no_vma;
-	}
-
 	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
 		int ret;
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+		if (page->page_ptr) {
+			/* still mapped from an earlier buffer */
+			BUG_ON(list_empty(&page->lru));
+			binder_lru_del(page);
+			continue;
+		}
+
+		if (vma == NULL && mm == NULL) {
+			mm = get_task_mm(proc->tsk);
+			if (mm) {
+				down_write(&mm->mmap_sem);
+				vma = proc->vma;
+			}
+		}
+		if (vma == NULL) {
+			printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
+			       "map pages in userspace, no vma\n", proc->pid);
+			goto err_no_vma;
+		}
+
+		page->page_ptr = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (page->page_ptr == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &page->page_ptr;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -667,7 +812,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, page->page_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
@@ -683,31 +828,116 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	return 0;
 
 free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		BUG_ON(page->page_ptr == NULL);
+		binder_lru_add(page);
+	}
+	return 0;
+
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
 err_alloc_page_failed:
-		;
-	}
 err_no_vma:
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
 	}
+	/* the pages mapped so far are complete, keep them for later */
+	binder_update_page_range(proc, 0, start, page_addr, NULL);
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+/*
+ * binder_shrink - unmap and free pages that no buffer uses any more
+ *
+ * Returns the number of such pages left.  Procs whose allocator or mm is
+ * busy are skipped, the pages are tried again on a later pass.
+ */
+static int binder_lru_pinned(struct binder_proc *proc)
+{
+	int pinned;
+
+	spin_lock(&binder_lru_lock);
+	pinned = proc->lru_pins;
+	spin_unlock(&binder_lru_lock);
+	return pinned;
+}
+
+static int binder_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+{
+	struct binder_lru_page *page;
+	struct binder_proc *proc;
+	struct mm_struct *mm;
+	void *page_addr;
+
+	if (!nr_to_scan)
+		return binder_lru_count;
+
+	spin_lock(&binder_lru_lock);
+	while (nr_to_scan-- > 0 && !list_empty(&binder_lru_pages)) {
+		page = list_first_entry(&binder_lru_pages,
+					struct binder_lru_page, lru);
+		proc = page->proc;
+		if (!mutex_trylock(&proc->alloc_lock)) {
+			list_move_tail(&page->lru, &binder_lru_pages);
+			continue;
+		}
+		/*
+		 * binder_free_proc() takes alloc_lock too, so it cannot keep
+		 * proc around past our mutex_unlock().  The pin can, it is
+		 * waited out before proc is freed.
+		 */
+		proc->lru_pins++;
+		list_del_init(&page->lru);
+		binder_lru_count--;
+		spin_unlock(&binder_lru_lock);
+
+		page_addr = proc->buffer + (page - proc->pages) * PAGE_SIZE;
+		mm = get_task_mm(proc->tsk);
+		if (mm && !down_read_trylock(&mm->mmap_sem)) {
+			mmput(mm);
+			binder_lru_add(page);
+		} else {
+			if (mm) {
+				if (proc->vma)
+					zap_page_range(proc->vma,
+						(uintptr_t)page_addr +
+						proc->user_buffer_offset,
+						PAGE_SIZE, NULL);
+				up_read(&mm->mmap_sem);
+				mmput(mm);
+			}
+			unmap_kernel_range((unsigned long)page_addr,
+					   PAGE_SIZE);
+			__free_page(page->page_ptr);
+			page->page_ptr = NULL;
+		}
+		mutex_unlock(&proc->alloc_lock);
+
+		spin_lock(&binder_lru_lock);
+		/* proc may be freed as soon as binder_lru_lock is dropped */
+		if (--proc->lru_pins == 0)
+			wake_up_all(&binder_lru_wait);
+	}
+	spin_unlock(&binder_lru_lock);
+
+	return binder_lru_count;
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static struct binder_buffer *__binder_alloc_buf(struct binder_proc *proc,
+						size_t data_size,
+						size_t offsets_size,
+						size_t extra_buffers_size,
+						int is_async)
 {
 	struct rb_node *n = proc->free_buffers.rb_node;
 	struct binder_buffer *buffer;
@@ -715,7 +945,8 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	struct rb_node *best_fit = NULL;
 	void *has_page_addr;
 	void *end_page_addr;
-	size_t size;
+	size_t size, alloc_size;
+	int class;
 
 	if (proc->vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf, no vma\n",
@@ -731,6 +962,13 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 			"size %zd-%zd\n", proc->pid, data_size, offsets_size);
 		return NULL;
 	}
+	size += ALIGN(extra_buffers_size, sizeof(void *));
+	if (size < extra_buffers_size) {
+		binder_user_error("binder: %d: got transaction with invalid "
+			"extra buffers size %zd\n", proc->pid,
+			extra_buffers_size);
+		return NULL;
+	}
 
 	if (is_async &&
 	    proc->free_async_space < size + sizeof(struct binder_buffer)) {
@@ -740,21 +978,46 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
+	class = binder_quick_class(size);
+	if (class >= 0) {
+		if (!list_empty(&proc->quick_buffers[class])) {
+			buffer = list_first_entry(&proc->quick_buffers[class],
+						  struct binder_buffer,
+						  quick_entry);
+			list_del(&buffer->quick_entry);
+			buffer->quick = 0;
+			proc->quick_count[class]--;
+			proc->quick_hits++;
+			goto got_buffer;
+		}
+		alloc_size = BINDER_QUICK_SIZE(class);
+	} else
+		alloc_size = size;
+
+retry:
+	n = proc->free_buffers.rb_node;
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(!buffer->free);
 		buffer_size = binder_buffer_size(proc, buffer);
 
-		if (size < buffer_size) {
+		if (alloc_size < buffer_size) {
 			best_fit = n;
 			n = n->rb_left;
-		} else if (size > buffer_size)
+		} else if (alloc_size > buffer_size)
 			n = n->rb_right;
 		else {
 			best_fit = n;
 			break;
 		}
 	}
+	if (best_fit == NULL && binder_flush_quick_buffers(proc))
+		goto retry;
+	if (best_fit == NULL && alloc_size != size) {
+		/* too full to round up, such a buffer is not kept quick */
+		alloc_size = size;
+		goto retry;
+	}
 	if (best_fit == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
 		       "no address space\n", proc->pid, size);
@@ -772,10 +1035,10 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	has_page_addr =
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
 	if (n == NULL) {
-		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
-			buffer_size = size; /* no room for other buffers */
+		if (alloc_size + sizeof(struct binder_buffer) + 4 >= buffer_size)
+			buffer_size = alloc_size; /* no room for other buffers */
 		else
-			buffer_size = size + sizeof(struct binder_buffer);
+			buffer_size = alloc_size + sizeof(struct binder_buffer);
 	}
 	end_page_addr =
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data + buffer_size);
@@ -787,18 +1050,22 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 
 	rb_erase(best_fit, &proc->free_buffers);
 	buffer->free = 0;
-	binder_insert_allocated_buffer(proc, buffer);
-	if (buffer_size != size) {
-		struct binder_buffer *new_buffer = (void *)buffer->data + size;
+	if (buffer_size != alloc_size) {
+		struct binder_buffer *new_buffer =
+			(void *)buffer->data + alloc_size;
 		list_add(&new_buffer->entry, &buffer->entry);
 		new_buffer->free = 1;
 		binder_insert_free_buffer(proc, new_buffer);
 	}
+got_buffer:
+	binder_insert_allocated_buffer(proc, buffer);
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got "
 		     "%p\n", proc->pid, size, buffer);
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
+	buffer->extra_buffers_size = extra_buffers_size;
+	buffer->allow_user_free = 0;
 	buffer->async_transaction = is_async;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
@@ -811,6 +1078,21 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size,
+					      size_t extra_buffers_size,
+					      int is_async)
+{
+	struct binder_buffer *buffer;
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = __binder_alloc_buf(proc, data_size, offsets_size,
+				    extra_buffers_size, is_async);
+	mutex_unlock(&proc->alloc_lock);
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -868,15 +1150,71 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
+/*
+ * Unmap the pages only the buffer uses, merge it with free neighbours and
+ * put it in the free tree.
+ */
+static void binder_release_buffer(struct binder_proc *proc,
+				  struct binder_buffer *buffer)
+{
+	size_t buffer_size = binder_buffer_size(proc, buffer);
+
+	binder_update_page_range(proc, 0,
+		(void *)PAGE_ALIGN((uintptr_t)buffer->data),
+		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK),
+		NULL);
+	buffer->free = 1;
+	if (!list_is_last(&buffer->entry, &proc->buffers)) {
+		struct binder_buffer *next = list_entry(buffer->entry.next,
+						struct binder_buffer, entry);
+		if (next->free) {
+			rb_erase(&next->rb_node, &proc->free_buffers);
+			binder_delete_free_buffer(proc, next);
+		}
+	}
+	if (proc->buffers.next != &buffer->entry) {
+		struct binder_buffer *prev = list_entry(buffer->entry.prev,
+						struct binder_buffer, entry);
+		if (prev->free) {
+			binder_delete_free_buffer(proc, buffer);
+			rb_erase(&prev->rb_node, &proc->free_buffers);
+			buffer = prev;
+		}
+	}
+	binder_insert_free_buffer(proc, buffer);
+}
+
+/* Give the quick lists back to the free tree, returns the buffer count */
+static int binder_flush_quick_buffers(struct binder_proc *proc)
+{
+	struct binder_buffer *buffer, *tmp;
+	int class, count = 0;
+
+	for (class = 0; class < BINDER_QUICK_CLASSES; class++) {
+		list_for_each_entry_safe(buffer, tmp,
+					 &proc->quick_buffers[class],
+					 quick_entry) {
+			list_del(&buffer->quick_entry);
+			buffer->quick = 0;
+			binder_release_buffer(proc, buffer);
+			count++;
+		}
+		proc->quick_count[class] = 0;
+	}
+	return count;
+}
+
+static void __binder_free_buf(struct binder_proc *proc,
+			      struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
+	int class;
 
 	buffer_size = binder_buffer_size(proc, buffer);
 
 	size = ALIGN(buffer->data_size, sizeof(void *)) +
-		ALIGN(buffer->offsets_size, sizeof(void *));
+		ALIGN(buffer->offsets_size, sizeof(void *)) +
+		ALIGN(buffer->extra_buffers_size, sizeof(void *));
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_free_buf %p size %zd buffer"
@@ -897,30 +1235,25 @@ static void binder_free_buf(struct binder_proc *proc,
 			     proc->free_async_space);
 	}
 
-	binder_update_page_range(proc, 0,
-		(void *)PAGE_ALIGN((uintptr_t)buffer->data),
-		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK),
-		NULL);
 	rb_erase(&buffer->rb_node, &proc->allocated_buffers);
-	buffer->free = 1;
-	if (!list_is_last(&buffer->entry, &proc->buffers)) {
-		struct binder_buffer *next = list_entry(buffer->entry.next,
-						struct binder_buffer, entry);
-		if (next->free) {
-			rb_erase(&next->rb_node, &proc->free_buffers);
-			binder_delete_free_buffer(proc, next);
-		}
-	}
-	if (proc->buffers.next != &buffer->entry) {
-		struct binder_buffer *prev = list_entry(buffer->entry.prev,
-						struct binder_buffer, entry);
-		if (prev->free) {
-			binder_delete_free_buffer(proc, buffer);
-			rb_erase(&prev->rb_node, &proc->free_buffers);
-			buffer = prev;
-		}
+
+	class = binder_quick_class(size);
+	if (class >= 0 && proc->quick_count[class] < BINDER_QUICK_DEPTH &&
+	    buffer_size >= BINDER_QUICK_SIZE(class)) {
+		buffer->quick = 1;
+		list_add(&buffer->quick_entry, &proc->quick_buffers[class]);
+		proc->quick_count[class]++;
+		return;
 	}
-	binder_insert_free_buffer(proc, buffer);
+	binder_release_buffer(proc, buffer);
+}
+
+static void binder_free_buf(struct binder_proc *proc,
+			    struct binder_buffer *buffer)
+{
+	mutex_lock(&proc->alloc_lock);
+	__binder_free_buf(proc, buffer);
+	mutex_unlock(&proc->alloc_lock);
 }
 
 static struct binder_node *binder_get_node(struct binder_proc *proc,
@@ -982,6 +1315,18 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	return node;
 }
 
+static struct binder_latency *binder_get_node_latency(struct binder_node *node)
+{
+	if (node->latency == NULL) {
+		node->latency = kzalloc(sizeof(*node->latency), GFP_KERNEL);
+		if (node->latency == NULL)
+			return NULL;
+		node->latency->ref = 1;
+	}
+	node->latency->ref++;
+	return node->latency;
+}
+
 static int binder_inc_node(struct binder_node *node, int strong, int internal,
 			   struct list_head *target_list)
 {
@@ -1017,6 +1362,29 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 	return 0;
 }
 
+/*
+ * Free a node that has been unlinked from its proc or the dead list.  A node
+ * pinned with tmp_refs is only marked, and freed by binder_node_dec_tmpref().
+ */
+static void binder_free_node(struct binder_node *node)
+{
+	if (node->tmp_refs) {
+		node->is_deleted = 1;
+		return;
+	}
+	binder_put_latency(node->latency);
+	kfree(node);
+	binder_stats_deleted(BINDER_STAT_NODE);
+}
+
+static void binder_node_dec_tmpref(struct binder_node *node)
+{
+	BUG_ON(node->tmp_refs <= 0);
+	node->tmp_refs--;
+	if (node->is_deleted && node->tmp_refs == 0)
+		binder_free_node(node);
+}
+
 static int binder_dec_node(struct binder_node *node, int strong, int internal)
 {
 	if (strong) {
@@ -1052,8 +1420,7 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 					     "binder: dead node %d deleted\n",
 					     node->debug_id);
 			}
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
+			binder_free_node(node);
 		}
 	}
 
@@ -1241,6 +1608,7 @@ static void binder_pop_transaction(struct binder_thread *target_thread,
 	t->need_reply = 0;
 	if (t->buffer)
 		t->buffer->transaction = NULL;
+	binder_put_latency(t->latency);
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 }
@@ -1367,6 +1735,9 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				task_close_fd(proc, fp->handle);
 			break;
 
+		case BINDER_TYPE_PTR:
+			break;
+
 		default:
 			printk(KERN_ERR "binder: transaction release %d bad "
 			       "object type %lx\n", debug_id, fp->type);
@@ -1375,9 +1746,100 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	BUG_ON(proc->tmp_ref <= 0);
+	proc->tmp_ref--;
+	if (proc->is_dead && proc->tmp_ref == 0)
+		binder_free_proc(proc);
+}
+
+static struct binder_node *binder_get_target_node(struct binder_proc *proc,
+						  struct binder_thread *thread,
+						  size_t handle,
+						  uint32_t *return_error)
+{
+	struct binder_ref *ref;
+
+	if (handle == 0) {
+		if (binder_context_mgr_node == NULL)
+			*return_error = BR_DEAD_REPLY;
+		return binder_context_mgr_node;
+	}
+	ref = binder_get_ref(proc, handle);
+	if (ref == NULL) {
+		binder_user_error("binder: %d:%d got "
+			"transaction to invalid handle\n",
+			proc->pid, thread->pid);
+		*return_error = BR_FAILED_REPLY;
+		return NULL;
+	}
+	return ref->node;
+}
+
+/*
+ * Copy the buffers described by BINDER_TYPE_PTR objects into the space
+ * reserved after the offsets and point the objects at the copies in the
+ * target.  A bad offset fails the whole transaction, so that no object the
+ * translation below accepts can have been skipped here.
+ */
+static const char *binder_copy_sg_buffers(struct binder_proc *target_proc,
+					  struct binder_buffer *buffer)
+{
+	size_t *offp, *off_end;
+	void *sg_buf, *sg_end;
+
+	BUILD_BUG_ON(sizeof(struct binder_buffer_object) !=
+		     sizeof(struct flat_binder_object));
+	offp = (size_t *)(buffer->data +
+			  ALIGN(buffer->data_size, sizeof(void *)));
+	off_end = offp + buffer->offsets_size / sizeof(size_t);
+	sg_buf = (void *)offp + ALIGN(buffer->offsets_size, sizeof(void *));
+	sg_end = sg_buf + ALIGN(buffer->extra_buffers_size, sizeof(void *));
+
+	for (; offp < off_end; offp++) {
+		struct binder_buffer_object *bp;
+		size_t length;
+
+		if (*offp > buffer->data_size - sizeof(*bp) ||
+		    buffer->data_size < sizeof(*bp) ||
+		    !IS_ALIGNED(*offp, sizeof(void *)))
+			return "offsets";
+		bp = (struct binder_buffer_object *)(buffer->data + *offp);
+		if (bp->type != BINDER_TYPE_PTR)
+			continue;
+		length = ALIGN(bp->length, sizeof(void *));
+		if (bp->flags || length < bp->length ||
+		    length > sg_end - sg_buf ||
+		    copy_from_user(sg_buf, bp->buffer, bp->length))
+			return "sg buffer";
+		bp->buffer = sg_buf + target_proc->user_buffer_offset;
+		sg_buf += length;
+	}
+	return NULL;
+}
+
+/*
+ * A synchronous transaction from a thread that is serving a transaction
+ * from target_proc goes to the thread of target_proc that waits for it.
+ */
+static struct binder_thread *
+binder_stack_target_thread(struct binder_thread *thread,
+			   struct binder_proc *target_proc)
+{
+	struct binder_transaction *tmp;
+	struct binder_thread *target_thread = NULL;
+
+	for (tmp = thread->transaction_stack; tmp; tmp = tmp->from_parent)
+		if (tmp->from && tmp->from->proc == target_proc)
+			target_thread = tmp->from;
+	return target_thread;
+}
+
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+			       struct binder_transaction_data *tr, int reply,
+			       size_t extra_buffers_size)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
@@ -1388,7 +1850,10 @@ static void binder_transaction(struct binder_proc *proc,
 	struct list_head *target_list;
 	wait_queue_head_t *target_wait;
 	struct binder_transaction *in_reply_to = NULL;
-	struct binder_transaction_log_entry *e;
+	struct binder_transaction_log_entry *e, log_e;
+	struct binder_buffer *buffer;
+	const char *copy_failed = NULL;
+	int target_node_dead = 0;
 	uint32_t return_error;
 
 	e = binder_transaction_log_add(&binder_transaction_log);
@@ -1443,24 +1908,11 @@ static void binder_transaction(struct binder_proc *proc,
 		}
 		target_proc = target_thread->proc;
 	} else {
-		if (tr->target.handle) {
-			struct binder_ref *ref;
-			ref = binder_get_ref(proc, tr->target.handle);
-			if (ref == NULL) {
-				binder_user_error("binder: %d:%d got "
-					"transaction to invalid handle\n",
-					proc->pid, thread->pid);
-				return_error = BR_FAILED_REPLY;
-				goto err_invalid_target_handle;
-			}
-			target_node = ref->node;
-		} else {
-			target_node = binder_context_mgr_node;
-			if (target_node == NULL) {
-				return_error = BR_DEAD_REPLY;
-				goto err_no_context_mgr_node;
-			}
-		}
+		target_node = binder_get_target_node(proc, thread,
+						     tr->target.handle,
+						     &return_error);
+		if (target_node == NULL)
+			goto err_invalid_target_handle;
 		e->to_node = target_node->debug_id;
 		target_proc = target_node->proc;
 		if (target_proc == NULL) {
@@ -1481,21 +1933,8 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
-			while (tmp) {
-				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
-				tmp = tmp->from_parent;
-			}
 		}
 	}
-	if (target_thread) {
-		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1515,6 +1954,8 @@ static void binder_transaction(struct binder_proc *proc,
 
 	t->debug_id = ++binder_last_id;
 	e->debug_id = t->debug_id;
+	if (binder_latency_stats && !reply)
+		t->start_time = ktime_get();
 
 	if (reply)
 		binder_debug(BINDER_DEBUG_TRANSACTION,
@@ -1539,34 +1980,117 @@ static void binder_transaction(struct binder_proc *proc,
 		t->from = NULL;
 	t->sender_euid = proc->tsk->cred->euid;
 	t->to_proc = target_proc;
-	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
 	t->priority = task_nice(current);
-	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
-		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
-	if (t->buffer == NULL) {
+
+	/*
+	 * Allocating the buffer may have to map pages into the target and
+	 * copying the payload may fault, so do both without binder_lock.
+	 * The tmp_refs keep target_proc, its buffers and target_node around
+	 * if they die in the meantime; everything else is looked up again
+	 * below.
+	 */
+	target_proc->tmp_ref++;
+	if (target_node)
+		target_node->tmp_refs++;
+	if (!reply && !(tr->flags & TF_ONE_WAY))
+		target_thread = binder_stack_target_thread(thread, target_proc);
+	if (target_thread)
+		e->to_thread = target_thread->pid;
+	/*
+	 * The log slot may be reused by other transactions while
+	 * binder_lock is dropped; the entry is complete by now, so keep a
+	 * copy of it for the failed transaction log.
+	 */
+	log_e = *e;
+	e = &log_e;
+	mutex_unlock(&binder_lock);
+
+	offp = NULL;
+	buffer = binder_alloc_buf(target_proc, tr->data_size,
+		tr->offsets_size, extra_buffers_size,
+		!reply && (t->flags & TF_ONE_WAY));
+	if (buffer) {
+		offp = (size_t *)(buffer->data +
+				  ALIGN(tr->data_size, sizeof(void *)));
+		if (copy_from_user(buffer->data, tr->data.ptr.buffer,
+				   tr->data_size))
+			copy_failed = "data";
+		else if (copy_from_user(offp, tr->data.ptr.offsets,
+					tr->offsets_size))
+			copy_failed = "offsets";
+		else if (extra_buffers_size)
+			copy_failed = binder_copy_sg_buffers(target_proc,
+							     buffer);
+	}
+
+	mutex_lock(&binder_lock);
+	if (target_node) {
+		/*
+		 * Check the pinned node itself; once it is let go, a node
+		 * freed in the meantime could be reused at the same address.
+		 */
+		target_node_dead = target_node->is_deleted ||
+				   target_node->proc != target_proc;
+		binder_node_dec_tmpref(target_node);
+	}
+	if (buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
-	t->buffer->allow_user_free = 0;
+	if (reply) {
+		if (in_reply_to->from == NULL) {
+			return_error = BR_DEAD_REPLY;
+			goto err_target_changed;
+		}
+		if (target_thread->transaction_stack != in_reply_to) {
+			binder_user_error("binder: %d:%d got reply transaction "
+				"with bad target transaction stack %d, "
+				"expected %d\n",
+				proc->pid, thread->pid,
+				target_thread->transaction_stack ?
+				target_thread->transaction_stack->debug_id : 0,
+				in_reply_to->debug_id);
+			return_error = BR_FAILED_REPLY;
+			in_reply_to = NULL;
+			target_thread = NULL;
+			goto err_target_changed;
+		}
+	} else {
+		struct binder_node *node;
+
+		node = binder_get_target_node(proc, thread, tr->target.handle,
+					      &return_error);
+		if (node == NULL)
+			goto err_target_changed;
+		if (target_node_dead || node != target_node) {
+			return_error = BR_DEAD_REPLY;
+			goto err_target_changed;
+		}
+		if (!(tr->flags & TF_ONE_WAY))
+			target_thread = binder_stack_target_thread(thread,
+								   target_proc);
+	}
+	if (target_thread) {
+		target_list = &target_thread->todo;
+		target_wait = &target_thread->wait;
+	} else {
+		target_list = &target_proc->todo;
+		target_wait = &target_proc->wait;
+	}
+	t->to_thread = target_thread;
+
+	t->buffer = buffer;
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
 	if (target_node)
 		binder_inc_node(target_node, 1, 0, NULL);
 
-	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
-
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"data ptr\n", proc->pid, thread->pid);
-		return_error = BR_FAILED_REPLY;
-		goto err_copy_data_failed;
-	}
-	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
+	if (copy_failed) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
-			"offsets ptr\n", proc->pid, thread->pid);
+			"%s ptr\n", proc->pid, thread->pid, copy_failed);
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
@@ -1707,6 +2231,36 @@ static void binder_transaction(struct binder_proc *proc,
 			fp->handle = target_fd;
 		} break;
 
+		case BINDER_TYPE_PTR: {
+			struct binder_buffer_object *bp = (void *)fp;
+			void *sg_buf = t->buffer->data +
+				ALIGN(tr->data_size, sizeof(void *)) +
+				ALIGN(tr->offsets_size, sizeof(void *));
+			void *sg_end = sg_buf +
+				ALIGN(extra_buffers_size, sizeof(void *));
+			void *kbuf;
+
+			/*
+			 * binder_copy_sg_buffers() has copied the buffer and
+			 * pointed the object at the copy; refuse anything it
+			 * did not see or that was changed since.
+			 */
+			kbuf = (void *)bp->buffer -
+				target_proc->user_buffer_offset;
+			if (!extra_buffers_size || bp->flags ||
+			    kbuf < sg_buf || kbuf > sg_end ||
+			    bp->length > sg_end - kbuf) {
+				binder_user_error("binder: %d:%d got "
+					"transaction with invalid buffer "
+					"object\n", proc->pid, thread->pid);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_object_type;
+			}
+			binder_debug(BINDER_DEBUG_TRANSACTION,
+				     "        ptr %p size %zd\n",
+				     bp->buffer, bp->length);
+		} break;
+
 		default:
 			binder_user_error("binder: %d:%d got transactio"
 				"n with invalid object type, %lx\n",
@@ -1715,6 +2269,21 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
+	if (reply) {
+		t->latency = in_reply_to->latency;
+		t->start_time = in_reply_to->start_time;
+		in_reply_to->latency = NULL;
+	} else if (binder_latency_stats && target_node) {
+		size_t size = tr->data_size + tr->offsets_size +
+			      extra_buffers_size;
+
+		t->latency = binder_get_node_latency(target_node);
+		if (t->latency) {
+			t->queue_time = ktime_get();
+			binder_latency_add(t->latency->size, size);
+			binder_latency_add(proc->latency.size, size);
+		}
+	}
 	if (reply) {
 		BUG_ON(t->buffer->async_transaction != 0);
 		binder_pop_transaction(target_thread, in_reply_to);
@@ -1738,6 +2307,7 @@ static void binder_transaction(struct binder_proc *proc,
 	list_add_tail(&tcomplete->entry, &thread->todo);
 	if (target_wait)
 		wake_up_interruptible(target_wait);
+	binder_proc_dec_tmpref(target_proc);
 	return;
 
 err_get_unused_fd_failed:
@@ -1751,8 +2321,10 @@ err_bad_offset:
 err_copy_data_failed:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
 	t->buffer->transaction = NULL;
-	binder_free_buf(target_proc, t->buffer);
+err_target_changed:
+	binder_free_buf(target_proc, buffer);
 err_binder_alloc_buf_failed:
+	binder_proc_dec_tmpref(target_proc);
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 err_alloc_tcomplete_failed:
@@ -1763,7 +2335,6 @@ err_bad_call_stack:
 err_empty_call_stack:
 err_dead_binder:
 err_invalid_target_handle:
-err_no_context_mgr_node:
 	binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 		     "binder: %d:%d transaction failed %d, size %zd-%zd\n",
 		     proc->pid, thread->pid, return_error,
@@ -1975,7 +2546,19 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr, cmd == BC_REPLY, 0);
+			break;
+		}
+
+		case BC_TRANSACTION_SG:
+		case BC_REPLY_SG: {
+			struct binder_transaction_data_sg tr;
+
+			if (copy_from_user(&tr, ptr, sizeof(tr)))
+				return -EFAULT;
+			ptr += sizeof(tr);
+			binder_transaction(proc, thread, &tr.transaction_data,
+					   cmd == BC_REPLY_SG, tr.buffers_size);
 			break;
 		}
 
@@ -2352,8 +2935,7 @@ retry:
 						     proc->pid, thread->pid, node->debug_id,
 						     node->ptr, node->cookie);
 					rb_erase(&node->rb_node, &proc->nodes);
-					kfree(node);
-					binder_stats_deleted(BINDER_STAT_NODE);
+					binder_free_node(node);
 				} else {
 					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 						     "binder: %d:%d node %d u%p c%p state unchanged\n",
@@ -2423,6 +3005,21 @@ retry:
 		tr.flags = t->flags;
 		tr.sender_euid = t->sender_euid;
 
+		if (t->latency) {
+			ktime_t now = ktime_get();
+			s64 delta;
+
+			if (cmd == BR_REPLY) {
+				delta = ktime_us_delta(now, t->start_time);
+				binder_latency_add(t->latency->total, delta);
+				binder_latency_add(proc->latency.total, delta);
+			} else {
+				delta = ktime_us_delta(now, t->queue_time);
+				binder_latency_add(t->latency->queue, delta);
+				binder_latency_add(proc->latency.queue, delta);
+			}
+		}
+
 		if (t->from) {
 			struct task_struct *sender = t->from->proc->tsk;
 			tr.sender_pid = task_tgid_nr_ns(sender,
@@ -2466,6 +3063,7 @@ retry:
 			thread->transaction_stack = t;
 		} else {
 			t->buffer->transaction = NULL;
+			binder_put_latency(t->latency);
 			kfree(t);
 			binder_stats_deleted(BINDER_STAT_TRANSACTION);
 		}
@@ -2786,6 +3384,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
 	struct binder_buffer *buffer;
+	int i;
 
 	if ((vma->vm_end - vma->vm_start) > SZ_4M)
 		vma->vm_end = vma->vm_start + SZ_4M;
@@ -2833,6 +3432,10 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+		proc->pages[i].proc = proc;
+	}
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -2873,6 +3476,7 @@ err_bad_arg:
 static int binder_open(struct inode *nodp, struct file *filp)
 {
 	struct binder_proc *proc;
+	int i;
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE, "binder_open: %d:%d\n",
 		     current->group_leader->pid, current->pid);
@@ -2884,6 +3488,9 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
+	mutex_init(&proc->alloc_lock);
+	for (i = 0; i < BINDER_QUICK_CLASSES; i++)
+		INIT_LIST_HEAD(&proc->quick_buffers[i]);
 	proc->default_priority = task_nice(current);
 	mutex_lock(&binder_lock);
 	binder_stats_created(BINDER_STAT_PROC);
@@ -2943,9 +3550,8 @@ static int binder_release(struct inode *nodp, struct file *filp)
 static void binder_deferred_release(struct binder_proc *proc)
 {
 	struct hlist_node *pos;
-	struct binder_transaction *t;
 	struct rb_node *n;
-	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	int threads, nodes, incoming_refs, outgoing_refs, active_transactions;
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
@@ -2974,8 +3580,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 		rb_erase(&node->rb_node, &proc->nodes);
 		list_del_init(&node->work.entry);
 		if (hlist_empty(&node->refs)) {
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
+			binder_free_node(node);
 		} else {
 			struct binder_ref *ref;
 			int death = 0;
@@ -3011,8 +3616,25 @@ static void binder_deferred_release(struct binder_proc *proc)
 		binder_delete_ref(ref);
 	}
 	binder_release_work(&proc->todo);
-	buffers = 0;
 
+	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
+		     "binder_release: %d threads %d, nodes %d (ref %d), "
+		     "refs %d, active transactions %d\n",
+		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
+		     active_transactions);
+
+	proc->is_dead = 1;
+	if (proc->tmp_ref == 0)
+		binder_free_proc(proc);
+}
+
+static void binder_free_proc(struct binder_proc *proc)
+{
+	struct binder_transaction *t;
+	struct rb_node *n;
+	int buffers, page_count;
+
+	buffers = 0;
 	while ((n = rb_first(&proc->allocated_buffers))) {
 		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
 							rb_node);
@@ -3034,20 +3656,24 @@ static void binder_deferred_release(struct binder_proc *proc)
 	page_count = 0;
 	if (proc->pages) {
 		int i;
+		mutex_lock(&proc->alloc_lock);
 		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
+			if (proc->pages[i].page_ptr) {
 				void *page_addr = proc->buffer + i * PAGE_SIZE;
 				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 					     "binder_release: %d: "
 					     "page %d at %p not freed\n",
 					     proc->pid, i,
 					     page_addr);
+				binder_lru_del(&proc->pages[i]);
 				unmap_kernel_range((unsigned long)page_addr,
 					PAGE_SIZE);
-				__free_page(proc->pages[i]);
+				__free_page(proc->pages[i].page_ptr);
 				page_count++;
 			}
 		}
+		mutex_unlock(&proc->alloc_lock);
+		wait_event(binder_lru_wait, !binder_lru_pinned(proc));
 		kfree(proc->pages);
 		vfree(proc->buffer);
 	}
@@ -3055,11 +3681,8 @@ static void binder_deferred_release(struct binder_proc *proc)
 	put_task_struct(proc->tsk);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
-		     "binder_release: %d threads %d, nodes %d (ref %d), "
-		     "refs %d, active transactions %d, buffers %d, "
-		     "pages %d\n",
-		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
-		     active_transactions, buffers, page_count);
+		     "binder_release: %d buffers %d, pages %d\n",
+		     proc->pid, buffers, page_count);
 
 	kfree(proc);
 }
@@ -3279,9 +3902,11 @@ static void print_binder_proc(struct seq_file *m,
 			print_binder_ref(m, rb_entry(n, struct binder_ref,
 						     rb_node_desc));
 	}
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		print_binder_buffer(m, "  buffer",
 				    rb_entry(n, struct binder_buffer, rb_node));
+	mutex_unlock(&proc->alloc_lock);
 	list_for_each_entry(w, &proc->todo, entry)
 		print_binder_work(m, "  ", "  pending transaction", w);
 	list_for_each_entry(w, &proc->delivered_death, entry) {
@@ -3330,7 +3955,9 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_SG",
+	"BC_REPLY_SG"
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3383,6 +4010,8 @@ static void print_binder_proc_stats(struct seq_file *m,
 	struct binder_work *w;
 	struct rb_node *n;
 	int count, strong, weak;
+	int i, quick;
+	unsigned quick_hits;
 
 	seq_printf(m, "proc %d\n", proc->pid);
 	count = 0;
@@ -3411,9 +4040,15 @@ static void print_binder_proc_stats(struct seq_file *m,
 	seq_printf(m, "  refs: %d s %d w %d\n", count, strong, weak);
 
 	count = 0;
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
+	for (i = 0, quick = 0; i < BINDER_QUICK_CLASSES; i++)
+		quick += proc->quick_count[i];
+	quick_hits = proc->quick_hits;
+	mutex_unlock(&proc->alloc_lock);
 	seq_printf(m, "  buffers: %d\n", count);
+	seq_printf(m, "  quick buffers: %d hits %u\n", quick, quick_hits);
 
 	count = 0;
 	list_for_each_entry(w, &proc->todo, entry) {
@@ -3506,6 +4141,66 @@ static int binder_proc_show(struct seq_file *m, void *unused)
 	return 0;
 }
 
+static void print_binder_latency(struct seq_file *m, const char *prefix,
+				 const char *name, unsigned int *hist)
+{
+	int i;
+
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++)
+		if (hist[i])
+			break;
+	if (i == BINDER_LATENCY_BUCKETS)
+		return;
+
+	seq_printf(m, "%s%s:", prefix, name);
+	for (; i < BINDER_LATENCY_BUCKETS; i++) {
+		if (hist[i])
+			seq_printf(m, " %u:%u", i ? 1U << i : 0, hist[i]);
+	}
+	seq_puts(m, "\n");
+}
+
+static void print_binder_proc_latency(struct seq_file *m,
+				      struct binder_proc *proc)
+{
+	struct rb_node *n;
+
+	seq_printf(m, "proc %d\n", proc->pid);
+	print_binder_latency(m, "  ", "outgoing usec", proc->latency.total);
+	print_binder_latency(m, "  ", "outgoing bytes", proc->latency.size);
+	print_binder_latency(m, "  ", "incoming queue usec",
+			     proc->latency.queue);
+	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
+		struct binder_node *node = rb_entry(n, struct binder_node,
+						    rb_node);
+		if (node->latency == NULL)
+			continue;
+		seq_printf(m, "  node %d: u%p c%p\n",
+			   node->debug_id, node->ptr, node->cookie);
+		print_binder_latency(m, "    ", "usec", node->latency->total);
+		print_binder_latency(m, "    ", "queue usec",
+				     node->latency->queue);
+		print_binder_latency(m, "    ", "bytes", node->latency->size);
+	}
+}
+
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	int do_lock = !binder_debug_no_lock;
+
+	if (do_lock)
+		mutex_lock(&binder_lock);
+
+	seq_puts(m, "binder latency:\n");
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
+		print_binder_proc_latency(m, proc);
+	if (do_lock)
+		mutex_unlock(&binder_lock);
+	return 0;
+}
+
 static void print_binder_transaction_log_entry(struct seq_file *m,
 					struct binder_transaction_log_entry *e)
 {
@@ -3551,6 +4246,7 @@ BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
 BINDER_DEBUG_ENTRY(transaction_log);
+BINDER_DEBUG_ENTRY(latency);
 
 static int __init binder_init(void)
 {
@@ -3565,6 +4261,7 @@ static int __init binder_init(void)
 		binder_debugfs_dir_entry_proc = debugfs_create_dir("proc",
 						 binder_debugfs_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
+	register_shrinker(&binder_shrinker);
 	if (binder_debugfs_dir_entry_root) {
 		debugfs_create_file("state",
 				    S_IRUGO,
@@ -3591,6 +4288,11 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    &binder_transaction_log_failed,
 				    &binder_transaction_log_fops);
+		debugfs_create_file("latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_fops);
 	}
 	return ret;
 }
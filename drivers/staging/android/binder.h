@@ -32,6 +32,7 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_PTR		= B_PACK_CHARS('p', 't', '*', B_TYPE_LARGE),
 };
 
 enum {
@@ -61,6 +62,21 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+/*
+ * A BINDER_TYPE_PTR object takes the place of a flat_binder_object in the
+ * data and describes a separate buffer in the sender.  It is only accepted
+ * with BC_TRANSACTION_SG and BC_REPLY_SG: the driver copies the buffer
+ * straight into the target's transaction buffer, after the offsets, and
+ * rewrites 'buffer' to point at the copy.  Large payloads therefore do not
+ * have to be flattened into the data first.
+ */
+struct binder_buffer_object {
+	unsigned long		type;
+	unsigned long		flags;	/* must be 0 */
+	const void		*buffer;
+	size_t			length;
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
@@ -147,6 +163,11 @@ struct binder_transaction_data {
 	} data;
 };
 
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	size_t		buffers_size;	/* total aligned size of ptr buffers */
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +345,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, plus the space to
+	 * reserve in the target buffer for BINDER_TYPE_PTR buffers.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
@@ -21,47 +21,67 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/*
+ * struct logger_cpu_log - one CPU's ring buffer of a log
+ *
+ * Only tasks running on this CPU write to it, with preemption disabled, so
+ * writers never contend. Positions are byte counts since the log was
+ * created; their offset into the buffer is logger_offset(). Readers run
+ * locklessly alongside the writer: they only trust an entry they copied
+ * out if 'head' has not moved past it in the meantime. Both the buffer and
+ * its cursors live in the log's map, which readers may mmap().
+ */
+struct logger_cpu_log {
+	unsigned char		*buffer;/* the ring buffer itself */
+	struct logger_ring	*ring;	/* its head, tail and start */
+};
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting. Each CPU logs into a buffer of its
+ * own; readers merge them back into timestamp order.
  */
 struct logger_log {
-	unsigned char 		*buffer;/* the ring buffer itself */
+	struct logger_cpu_log __percpu *cpu_log; /* per-CPU ring buffers */
+	struct logger_map	*map;	/* cursors and buffers, for mmap() */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
-	size_t			size;	/* size of the log */
+	size_t			size;	/* size of each CPU's buffer */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by 'mutex'.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* serializes readers of this file */
+	u32			*r_pos;	/* read position in each CPU's log */
+	unsigned char		*entry;	/* the entry being read */
+	int			mode;	/* LOGGER_READ_ENTRY or _BATCH */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/* pos_before - is position a before b, allowing for wrap-around? */
+#define pos_before(a, b)	((s32)((a) - (b)) < 0)
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -86,58 +106,159 @@ static inline struct logger_log *file_get_log(struct file *file)
 }
 
 /*
- * get_entry_len - Grabs the length of the payload of the next entry starting
- * from 'off'.
+ * copy_from_log - copies 'count' bytes at position 'pos' of a CPU's log into
+ * 'buf'. The result is only valid if 'pos' is not before the log's head once
+ * the copy is done.
+ */
+static void copy_from_log(struct logger_log *log, struct logger_cpu_log *cl,
+			  u32 pos, void *buf, size_t count)
+{
+	size_t off = logger_offset(pos);
+	size_t len;
+
+	len = min(count, log->size - off);
+	memcpy(buf, cl->buffer + off, len);
+
+	if (count != len)
+		memcpy(buf + len, cl->buffer, count - len);
+}
+
+/*
+ * get_entry_len - Grabs the length of the next entry starting from 'pos'.
  *
- * Caller needs to hold log->mutex.
+ * Only called by the writer of 'cl', so the entry can't change under us.
  */
-static __u32 get_entry_len(struct logger_log *log, size_t off)
+static __u32 get_entry_len(struct logger_log *log, struct logger_cpu_log *cl,
+			   u32 pos)
 {
 	__u16 val;
 
-	switch (log->size - off) {
-	case 1:
-		memcpy(&val, log->buffer + off, 1);
-		memcpy(((char *) &val) + 1, log->buffer, 1);
-		break;
-	default:
-		memcpy(&val, log->buffer + off, 2);
-	}
+	copy_from_log(log, cl, pos, &val, sizeof(val));
 
 	return sizeof(struct logger_entry) + val;
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * log_start - the first position of 'cl' a reader may read from, which is the
+ * head or, after a flush, the flush point.
+ */
+static u32 log_start(struct logger_cpu_log *cl)
+{
+	u32 head = ACCESS_ONCE(cl->ring->head);
+	u32 start = ACCESS_ONCE(cl->ring->start);
+
+	return pos_before(start, head) ? head : start;
+}
+
+/*
+ * peek_entry - reads the header of the reader's next entry in 'cpu's log.
+ * Returns 1 if there is one, 0 if the reader has read everything.
  *
- * Caller must hold log->mutex.
+ * Caller must hold reader->mutex.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static int peek_entry(struct logger_reader *reader, int cpu,
+		      struct logger_entry *header)
 {
-	size_t len;
+	struct logger_log *log = reader->log;
+	struct logger_cpu_log *cl = per_cpu_ptr(log->cpu_log, cpu);
+	u32 pos, start, tail;
 
-	/*
-	 * We read from the log in two disjoint operations. First, we read from
-	 * the current read head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
-	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
-		return -EFAULT;
+	do {
+		/* skip over entries the writer has dropped or flushed */
+		pos = reader->r_pos[cpu];
+		start = log_start(cl);
+		if (pos_before(pos, start))
+			pos = reader->r_pos[cpu] = start;
+
+		tail = ACCESS_ONCE(cl->ring->tail);
+		smp_rmb();
+		if (pos == tail)
+			return 0;
+
+		copy_from_log(log, cl, pos, header, sizeof(*header));
+		smp_rmb();
+	} while (pos_before(pos, ACCESS_ONCE(cl->ring->head)));
+
+	return 1;
+}
+
+/*
+ * next_entry_cpu - finds the CPU whose log holds the oldest entry the reader
+ * has not read yet, merging the per-CPU logs back into timestamp order.
+ * Returns the CPU and fills in 'header', or returns -1 if there is nothing
+ * left to read.
+ *
+ * Caller must hold reader->mutex.
+ */
+static int next_entry_cpu(struct logger_reader *reader,
+			  struct logger_entry *header)
+{
+	struct logger_entry h;
+	int cpu, next = -1;
+
+	for_each_possible_cpu(cpu) {
+		if (!peek_entry(reader, cpu, &h))
+			continue;
+
+		if (next < 0 || h.sec < header->sec ||
+		    (h.sec == header->sec && h.nsec < header->nsec)) {
+			*header = h;
+			next = cpu;
+		}
+	}
+
+	return next;
+}
+
+/*
+ * reader_empty - is there nothing for the reader to read? May be called
+ * without reader->mutex, in which case the answer is only a hint.
+ */
+static int reader_empty(struct logger_reader *reader)
+{
+	struct logger_log *log = reader->log;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct logger_cpu_log *cl = per_cpu_ptr(log->cpu_log, cpu);
+
+		if (ACCESS_ONCE(cl->ring->tail) != ACCESS_ONCE(reader->r_pos[cpu]))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * do_read_log_to_user - reads the next entry, which is 'header' in 'cpu's log,
+ * into the user-space buffer 'buf'. Returns the entry's length on success, or
+ * -EAGAIN if the writer overwrote it while we were reading it.
+ *
+ * Caller must hold reader->mutex.
+ */
+static ssize_t do_read_log_to_user(struct logger_reader *reader, int cpu,
+				   struct logger_entry *header,
+				   char __user *buf)
+{
+	struct logger_log *log = reader->log;
+	struct logger_cpu_log *cl = per_cpu_ptr(log->cpu_log, cpu);
+	u32 pos = reader->r_pos[cpu];
+	size_t count = sizeof(struct logger_entry) + header->len;
 
 	/*
-	 * Second, we read any remaining bytes, starting back at the head of
-	 * the log.
+	 * We can't copy straight to user-space, since the writer may lap us
+	 * while we fault. Copy the entry out and check that it is still intact
+	 * before handing it over.
 	 */
-	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+	copy_from_log(log, cl, pos, reader->entry, count);
+	smp_rmb();
+	if (pos_before(pos, ACCESS_ONCE(cl->ring->head)))
+		return -EAGAIN;
+
+	if (copy_to_user(buf, reader->entry, count))
+		return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
+	reader->r_pos[cpu] = pos + count;
 
 	return count;
 }
@@ -149,26 +270,27 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry or, in LOGGER_READ_BATCH mode,
+ * 	  as many whole entries as fit in the buffer
  *
- * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
- * buffer is insufficient to hold next entry.
+ * Optimal read size is LOGGER_ENTRY_MAX_LEN, or larger in batch mode. Will
+ * set errno to EINVAL if read buffer is insufficient to hold next entry.
  */
 static ssize_t logger_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *pos)
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
-	ssize_t ret;
+	struct logger_entry header;
+	ssize_t ret, len;
+	int cpu;
 	DEFINE_WAIT(wait);
 
 start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		ret = reader_empty(reader);
 		if (!ret)
 			break;
 
@@ -189,131 +311,169 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	mutex_lock(&reader->mutex);
 
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
+	while (1) {
+		/* is there still something to read or did we race? */
+		cpu = next_entry_cpu(reader, &header);
+		if (cpu < 0)
+			break;
 
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
+		if (count - ret < sizeof(struct logger_entry) + header.len) {
+			if (!ret)
+				ret = -EINVAL;
+			break;
+		}
+
+		len = do_read_log_to_user(reader, cpu, &header, buf + ret);
+		if (len == -EAGAIN)
+			continue;
+		if (len < 0) {
+			if (!ret)
+				ret = len;
+			break;
+		}
+
+		ret += len;
+		if (reader->mode != LOGGER_READ_BATCH)
+			break;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	mutex_unlock(&reader->mutex);
 
-out:
-	mutex_unlock(&log->mutex);
+	if (unlikely(!ret))
+		goto start;
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * make_room - drops the oldest entries of the current CPU's log until 'len'
+ * more bytes fit. The new head is published before any of the dropped bytes
+ * are overwritten, so that readers notice they lost them.
  *
- * Caller must hold log->mutex.
+ * Caller must have preemption disabled.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static void make_room(struct logger_log *log, struct logger_cpu_log *cl,
+		      size_t len)
 {
-	size_t count = 0;
+	u32 head = cl->ring->head;
+	u32 start;
 
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
+	while (cl->ring->tail + len - head > log->size)
+		head += get_entry_len(log, cl, head);
 
-	return off;
-}
+	if (head == cl->ring->head)
+		return;
 
-/*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
- */
-static inline int clock_interval(size_t a, size_t b, size_t c)
-{
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
-	}
+	cl->ring->head = head;
+	smp_wmb();
 
-	return 0;
+	/* a flush on another CPU may move 'start' concurrently */
+	start = ACCESS_ONCE(cl->ring->start);
+	if (pos_before(start, head))
+		cmpxchg(&cl->ring->start, start, head);
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * do_write_log - writes 'count' bytes from 'buf' to the current CPU's log at
+ * position 'pos'
  *
- * The caller needs to hold log->mutex.
+ * Caller must have preemption disabled.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void do_write_log(struct logger_log *log, struct logger_cpu_log *cl,
+			 u32 pos, const void *buf, size_t count)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	size_t off = logger_offset(pos);
+	size_t len;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	len = min(count, log->size - off);
+	memcpy(cl->buffer + off, buf, len);
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	if (count != len)
+		memcpy(cl->buffer, buf + len, count - len);
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log_from_user - writes 'count' bytes from the user-space buffer
+ * 'buf' to the current CPU's log at position 'pos'
+ *
+ * Caller must have preemption disabled, so we can't fault the user pages in.
  *
- * The caller needs to hold log->mutex.
+ * Returns 'count' on success, -EFAULT if a page was not present.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static ssize_t do_write_log_from_user(struct logger_log *log,
+				      struct logger_cpu_log *cl,
+				      u32 pos,
+				      const void __user *buf, size_t count)
 {
+	size_t off = logger_offset(pos);
 	size_t len;
+	unsigned long left;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
-
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
+	pagefault_disable();
+	len = min(count, log->size - off);
+	left = __copy_from_user_inatomic(cl->buffer + off, buf, len);
+	if (!left && count != len)
+		left = __copy_from_user_inatomic(cl->buffer, buf + len,
+						 count - len);
+	pagefault_enable();
 
+	return left ? -EFAULT : count;
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
+ * write_entry - reserves room for, writes and commits one entry in the
+ * current CPU's log. The payload comes from 'kbuf' if set, or else from the
+ * iovec, in which case this returns -EFAULT if it was not all paged in.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static ssize_t write_entry(struct logger_log *log, struct logger_entry *header,
+			   const struct iovec *iov, unsigned long nr_segs,
+			   const char *kbuf)
 {
-	size_t len;
+	struct logger_cpu_log *cl;
+	u32 pos;
+	ssize_t ret = 0;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	cl = per_cpu_ptr(log->cpu_log, get_cpu());
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+	make_room(log, cl, sizeof(struct logger_entry) + header->len);
 
-	log->w_off = logger_offset(log->w_off + count);
+	pos = cl->ring->tail;
+	do_write_log(log, cl, pos, header, sizeof(struct logger_entry));
+	pos += sizeof(struct logger_entry);
 
-	return count;
+	if (kbuf) {
+		do_write_log(log, cl, pos, kbuf, header->len);
+		ret = header->len;
+	} else {
+		while (nr_segs-- > 0) {
+			size_t len;
+			ssize_t nr;
+
+			/* figure out how much of this vector we can keep */
+			len = min_t(size_t, iov->iov_len, header->len - ret);
+
+			/* write out this segment's payload */
+			nr = do_write_log_from_user(log, cl, pos + ret,
+						    iov->iov_base, len);
+			if (unlikely(nr < 0)) {
+				put_cpu();
+				return nr;
+			}
+
+			iov++;
+			ret += nr;
+		}
+	}
+
+	/* commit: make the entry visible to readers */
+	smp_wmb();
+	cl->ring->tail = pos + ret;
+
+	put_cpu();
+
+	return ret;
 }
 
 /*
@@ -325,10 +485,9 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
-	ssize_t ret = 0;
+	ssize_t ret;
 
 	now = current_kernel_time();
 
@@ -342,41 +501,40 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	ret = write_entry(log, &header, iov, nr_segs, NULL);
 
 	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * Part of the payload was not paged in. Fault it in with a copy of our
+	 * own and write that instead.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	if (unlikely(ret == -EFAULT)) {
+		char *kbuf;
+		size_t off = 0;
 
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
+		kbuf = kmalloc(header.len, GFP_KERNEL);
+		if (!kbuf)
+			return -ENOMEM;
 
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+		while (off < header.len) {
+			size_t len = min_t(size_t, iov->iov_len,
+					   header.len - off);
 
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			if (copy_from_user(kbuf + off, iov->iov_base, len)) {
+				kfree(kbuf);
+				return -EFAULT;
+			}
+			iov++;
+			off += len;
 		}
 
-		iov++;
-		ret += nr;
+		ret = write_entry(log, &header, NULL, 0, kbuf);
+		kfree(kbuf);
 	}
 
-	mutex_unlock(&log->mutex);
-
 	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
 
 	return ret;
 }
@@ -403,18 +561,27 @@ static int logger_open(struct inode *inode, struct file *file)
 
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader;
+		int cpu;
 
 		reader = kmalloc(sizeof(struct logger_reader), GFP_KERNEL);
 		if (!reader)
 			return -ENOMEM;
 
-		reader->log = log;
-		INIT_LIST_HEAD(&reader->list);
+		reader->r_pos = kcalloc(nr_cpu_ids, sizeof(u32), GFP_KERNEL);
+		reader->entry = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!reader->r_pos || !reader->entry) {
+			kfree(reader->r_pos);
+			kfree(reader->entry);
+			kfree(reader);
+			return -ENOMEM;
+		}
 
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		reader->log = log;
+		reader->mode = LOGGER_READ_ENTRY;
+		mutex_init(&reader->mutex);
+		for_each_possible_cpu(cpu)
+			reader->r_pos[cpu] =
+				log_start(per_cpu_ptr(log->cpu_log, cpu));
 
 		file->private_data = reader;
 	} else
@@ -432,7 +599,8 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		list_del(&reader->list);
+		kfree(reader->r_pos);
+		kfree(reader->entry);
 		kfree(reader);
 	}
 
@@ -462,21 +630,67 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	if (!reader_empty(reader))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
 
 	return ret;
 }
 
+/*
+ * logger_mmap - maps the log's cursors and buffers (struct logger_map)
+ * read-only into a reader's address space
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EACCES;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, log->map, vma->vm_pgoff);
+}
+
+/*
+ * set_read_pos - moves the reader to the positions in the user-space array
+ * 'upos', one per possible CPU, as left behind by reading the log's map
+ */
+static long set_read_pos(struct logger_reader *reader, u32 __user *upos)
+{
+	struct logger_log *log = reader->log;
+	u32 pos;
+	int cpu;
+
+	mutex_lock(&reader->mutex);
+	for_each_possible_cpu(cpu) {
+		struct logger_cpu_log *cl = per_cpu_ptr(log->cpu_log, cpu);
+
+		if (get_user(pos, upos + cpu)) {
+			mutex_unlock(&reader->mutex);
+			return -EFAULT;
+		}
+
+		/* stay within what has been written; peek_entry skips ahead */
+		if (pos_before(ACCESS_ONCE(cl->ring->tail), pos))
+			pos = ACCESS_ONCE(cl->ring->tail);
+		reader->r_pos[cpu] = pos;
+	}
+	mutex_unlock(&reader->mutex);
+
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	struct logger_cpu_log *cl;
+	struct logger_entry header;
 	long ret = -ENOTTY;
-
-	mutex_lock(&log->mutex);
+	int cpu;
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -488,10 +702,19 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		mutex_lock(&reader->mutex);
+		ret = 0;
+		for_each_possible_cpu(cpu) {
+			u32 pos = reader->r_pos[cpu];
+			u32 start;
+
+			cl = per_cpu_ptr(log->cpu_log, cpu);
+			start = log_start(cl);
+			if (pos_before(pos, start))
+				pos = start;
+			ret += ACCESS_ONCE(cl->ring->tail) - pos;
+		}
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -499,25 +722,49 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
+		mutex_lock(&reader->mutex);
+		if (next_entry_cpu(reader, &header) >= 0)
+			ret = sizeof(struct logger_entry) + header.len;
 		else
 			ret = 0;
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		/* readers, current and new, skip everything logged so far */
+		for_each_possible_cpu(cpu) {
+			cl = per_cpu_ptr(log->cpu_log, cpu);
+			ACCESS_ONCE(cl->ring->start) = ACCESS_ONCE(cl->ring->tail);
+		}
 		ret = 0;
 		break;
+	case LOGGER_SET_READ_MODE:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		if (arg != LOGGER_READ_ENTRY && arg != LOGGER_READ_BATCH) {
+			ret = -EINVAL;
+			break;
+		}
+		reader = file->private_data;
+		mutex_lock(&reader->mutex);
+		reader->mode = arg;
+		mutex_unlock(&reader->mutex);
+		ret = 0;
+		break;
+	case LOGGER_SET_READ_POS:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		ret = set_read_pos(file->private_data, (u32 __user *) arg);
+		break;
 	}
 
-	mutex_unlock(&log->mutex);
-
 	return ret;
 }
 
@@ -526,6 +773,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -533,14 +781,14 @@ static const struct file_operations logger_fops = {
 };
 
 /*
- * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * Defines a log structure with name 'NAME' and a buffer of 'SIZE' bytes for
+ * each possible CPU. 'SIZE' must be a power of two, a multiple of PAGE_SIZE,
+ * greater than LOGGER_ENTRY_MAX_LEN, and less than 2^31.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static DEFINE_PER_CPU(struct logger_cpu_log, _cpu_log_ ## VAR); \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
+	.cpu_log = &_cpu_log_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -548,10 +796,6 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
-	.head = 0, \
 	.size = SIZE, \
 };
 
@@ -575,7 +819,30 @@ static struct logger_log *get_log_from_minor(int minor)
 
 static int __init init_log(struct logger_log *log)
 {
-	int ret;
+	size_t data_offset;
+	int ret, cpu;
+
+	data_offset = PAGE_ALIGN(sizeof(struct logger_map) +
+				 nr_cpu_ids * sizeof(struct logger_ring));
+
+	log->map = vmalloc_user(data_offset + nr_cpu_ids * log->size);
+	if (unlikely(!log->map)) {
+		printk(KERN_ERR "logger: failed to allocate buffer "
+		       "for log '%s'!\n", log->misc.name);
+		return -ENOMEM;
+	}
+
+	log->map->nr_cpus = nr_cpu_ids;
+	log->map->size = log->size;
+	log->map->data_offset = data_offset;
+
+	for_each_possible_cpu(cpu) {
+		struct logger_cpu_log *cl = per_cpu_ptr(log->cpu_log, cpu);
+
+		cl->buffer = (unsigned char *) log->map + data_offset +
+			     cpu * log->size;
+		cl->ring = &log->map->ring[cpu];
+	}
 
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
@@ -584,8 +851,9 @@ static int __init init_log(struct logger_log *log)
 		return ret;
 	}
 
-	printk(KERN_INFO "logger: created %luK log '%s'\n",
-	       (unsigned long) log->size >> 10, log->misc.name);
+	printk(KERN_INFO "logger: created %luK log '%s' for each of %u cpus\n",
+	       (unsigned long) log->size >> 10, log->misc.name,
+	       num_possible_cpus());
 
 	return 0;
 }
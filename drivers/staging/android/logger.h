@@ -39,11 +39,50 @@ struct logger_entry {
 #define LOGGER_ENTRY_MAX_PAYLOAD	\
 	(LOGGER_ENTRY_MAX_LEN - sizeof(struct logger_entry))
 
+/*
+ * struct logger_ring - the write cursors of one CPU's ring buffer
+ *
+ * Positions are byte counts since the log was created, modulo 2^32; an entry
+ * at position 'pos' starts at byte 'pos % size' of the ring's buffer.
+ * Entries in [head, tail) are committed. Everything before 'start' was
+ * flushed and should be skipped.
+ */
+struct logger_ring {
+	__u32		head;	/* oldest entry in the buffer */
+	__u32		tail;	/* end of the newest committed entry */
+	__u32		start;	/* new readers start here */
+} __attribute__((aligned(64)));
+
+/*
+ * struct logger_map - the start of a log's read-only mmap() view
+ *
+ * It is followed by the rings' cursors, and 'data_offset' bytes into the
+ * mapping by the buffers of CPUs 0 to nr_cpus - 1, 'size' bytes each.
+ *
+ * A reader keeps a cursor of its own for each ring. It reads 'tail', then
+ * (after a read barrier) the entries from its cursor up to 'tail', and then
+ * checks that 'head' has not passed its cursor in the meantime; if it has,
+ * the writer lapped it and it restarts from 'head'. LOGGER_SET_READ_POS
+ * hands the cursors back to the kernel, so that poll() waits for new entries.
+ */
+struct logger_map {
+	__u32		nr_cpus;	/* number of rings */
+	__u32		size;		/* size of each ring's buffer */
+	__u32		data_offset;	/* offset of CPU 0's buffer */
+	struct logger_ring ring[0];
+} __attribute__((aligned(64)));
+
+/* Read modes, set with LOGGER_SET_READ_MODE */
+#define LOGGER_READ_ENTRY	0	/* one entry per read() */
+#define LOGGER_READ_BATCH	1	/* as many whole entries as fit */
+
 #define __LOGGERIO	0xAE
 
 #define LOGGER_GET_LOG_BUF_SIZE		_IO(__LOGGERIO, 1) /* size of log */
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_READ_MODE		_IO(__LOGGERIO, 5) /* read mode */
+#define LOGGER_SET_READ_POS		_IO(__LOGGERIO, 6) /* __u32[nr_cpus] */
 
 #endif /* _LINUX_LOGGER_H */
@@ -31,10 +31,18 @@
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
 #include <linux/mm.h>
+#include <linux/mutex.h>
 #include <linux/oom.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/notifier.h>
+#include <linux/workqueue.h>
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/lowmemorykiller.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -54,6 +62,43 @@ static int lowmem_minfree_size = 4;
 
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
+static ktime_t lowmem_deathpending_start;
+
+/* Kill latency histogram buckets: <1ms, <2ms, <4ms ... <1024ms, more */
+#define LOWMEM_LATENCY_BUCKETS	12
+#define LOWMEM_RECENT_KILLS	16
+
+struct lowmem_kill_record {
+	pid_t pid;
+	char comm[TASK_COMM_LEN];
+	int oom_adj;
+	int level;		/* index of the minfree level that was hit */
+	int tasksize;		/* pages */
+	s64 select_ns;		/* time spent choosing the victim */
+	s64 exit_ns;		/* from SIGKILL until freed, -1 if not yet */
+};
+
+static struct {
+	unsigned long kills;
+	unsigned long level_kills[ARRAY_SIZE(lowmem_adj)];
+	unsigned long rss_freed;	/* pages */
+	s64 select_ns_total;
+	s64 select_ns_max;
+	unsigned long deathpending_bails;	/* shrinks skipped */
+	unsigned long deathpending_timeouts;	/* victims that took > 1s */
+	unsigned long latency[LOWMEM_LATENCY_BUCKETS];
+	struct lowmem_kill_record recent[LOWMEM_RECENT_KILLS];
+	unsigned int recent_next;
+} lowmem_stats;
+
+/*
+ * Protects lowmem_stats and the death pending state. Taken from the task free
+ * notifier, which may run in softirq context.
+ */
+static DEFINE_SPINLOCK(lowmem_stats_lock);
+
+/* Serializes victim selection between the shrinker and lowmem_kill_work */
+static DEFINE_MUTEX(lowmem_kill_lock);
 
 #define lowmem_print(level, x...)			\
 	do {						\
@@ -72,27 +117,143 @@ static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
+	struct lowmem_kill_record *rec;
+	unsigned long flags;
+	s64 latency;
+	int bucket;
 
-	if (task == lowmem_deathpending)
+	if (task != lowmem_deathpending)
+		return NOTIFY_OK;
+
+	spin_lock_irqsave(&lowmem_stats_lock, flags);
+	if (task == lowmem_deathpending) {
 		lowmem_deathpending = NULL;
 
+		latency = ktime_to_ns(ktime_sub(ktime_get(),
+						lowmem_deathpending_start));
+		bucket = min(fls(div_s64(latency, NSEC_PER_MSEC)),
+			     LOWMEM_LATENCY_BUCKETS - 1);
+		lowmem_stats.latency[bucket]++;
+
+		rec = &lowmem_stats.recent[(lowmem_stats.recent_next - 1) %
+					   LOWMEM_RECENT_KILLS];
+		if (rec->pid == task->pid)
+			rec->exit_ns = latency;
+
+		trace_lowmem_kill_done(task, latency);
+	}
+	spin_unlock_irqrestore(&lowmem_stats_lock, flags);
+
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+/*
+ * Is a victim still on its way out? Counts how often that holds up reclaim,
+ * and how often a victim takes so long that we give up waiting for it.
+ */
+static int lowmem_death_pending(void)
+{
+	struct task_struct *p = lowmem_deathpending;
+	int timed_out;
+	int pending = 0;
+
+	if (!p)
+		return 0;
+
+	timed_out = time_after(jiffies, lowmem_deathpending_timeout);
+
+	spin_lock_irq(&lowmem_stats_lock);
+	/* The victim may have exited, and been cleared, in the meantime */
+	if (p == lowmem_deathpending) {
+		if (timed_out) {
+			lowmem_stats.deathpending_timeouts++;
+			lowmem_deathpending = NULL;
+		} else {
+			lowmem_stats.deathpending_bails++;
+			pending = 1;
+		}
+		trace_lowmem_deathpending(p, timed_out);
+	}
+	spin_unlock_irq(&lowmem_stats_lock);
+
+	return pending;
+}
+
+static void lowmem_record_kill(struct task_struct *p, int oom_adj,
+			       int tasksize, int level, s64 select_ns)
+{
+	struct lowmem_kill_record *rec;
+
+	spin_lock_irq(&lowmem_stats_lock);
+	lowmem_deathpending = p;
+	lowmem_deathpending_timeout = jiffies + HZ;
+	lowmem_deathpending_start = ktime_get();
+
+	lowmem_stats.kills++;
+	if (level < ARRAY_SIZE(lowmem_stats.level_kills))
+		lowmem_stats.level_kills[level]++;
+	lowmem_stats.rss_freed += tasksize;
+	lowmem_stats.select_ns_total += select_ns;
+	if (select_ns > lowmem_stats.select_ns_max)
+		lowmem_stats.select_ns_max = select_ns;
+
+	rec = &lowmem_stats.recent[lowmem_stats.recent_next++ %
+				   LOWMEM_RECENT_KILLS];
+	rec->pid = p->pid;
+	memcpy(rec->comm, p->comm, TASK_COMM_LEN);
+	rec->oom_adj = oom_adj;
+	rec->level = level;
+	rec->tasksize = tasksize;
+	rec->select_ns = select_ns;
+	rec->exit_ns = -1;
+	spin_unlock_irq(&lowmem_stats_lock);
+}
+
+/*
+ * Returns the index of the lowest minfree level that free memory is below, or
+ * -1 if there is enough.
+ */
+static int lowmem_level(int *other_free, int *other_file)
+{
+	int i;
+	int array_size = ARRAY_SIZE(lowmem_adj);
+
+	*other_free = global_page_state(NR_FREE_PAGES);
+	*other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM);
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	for (i = 0; i < array_size; i++) {
+		if (*other_free < lowmem_minfree[i] &&
+		    *other_file < lowmem_minfree[i])
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Kill the biggest task in the highest non-empty oom_adj bucket at or above
+ * the oom_adj of minfree level 'level'. Returns the victim's size in pages,
+ * or 0 if nothing was killed.
+ */
+static int lowmem_kill(int level, int other_free, int other_file)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
-	int rem = 0;
+	struct hlist_node *node;
+	ktime_t start;
 	int tasksize;
-	int i;
-	int min_adj = OOM_ADJUST_MAX + 1;
+	int adj;
+	int min_adj = lowmem_adj[level];
 	int selected_tasksize = 0;
-	int selected_oom_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
-	int other_free = global_page_state(NR_FREE_PAGES);
-	int other_file = global_page_state(NR_FILE_PAGES) -
-						global_page_state(NR_SHMEM);
+	int selected_oom_adj = min_adj;
+
+	if (!mutex_trylock(&lowmem_kill_lock))
+		return 0;
 
 	/*
 	 * If we already have a death outstanding, then
@@ -101,21 +262,103 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	 * this pass.
 	 *
 	 */
-	if (lowmem_deathpending &&
-	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+	if (lowmem_death_pending()) {
+		mutex_unlock(&lowmem_kill_lock);
 		return 0;
+	}
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		if (other_free < lowmem_minfree[i] &&
-		    other_file < lowmem_minfree[i]) {
-			min_adj = lowmem_adj[i];
-			break;
+	start = ktime_get();
+	rcu_read_lock();
+	for (adj = OOM_ADJUST_MAX; adj >= min_adj && !selected; adj--) {
+		hlist_for_each_entry_rcu(p, node, oom_adj_bucket(adj),
+					 oom_adj_node) {
+			struct mm_struct *mm;
+			struct signal_struct *sig;
+			int oom_adj;
+
+			task_lock(p);
+			mm = p->mm;
+			sig = p->signal;
+			if (!mm || !sig) {
+				task_unlock(p);
+				continue;
+			}
+			/* the bucket may be stale while oom_adj changes */
+			oom_adj = sig->oom_adj;
+			if (oom_adj < min_adj) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(mm);
+			task_unlock(p);
+			if (tasksize <= 0)
+				continue;
+			if (selected) {
+				if (oom_adj < selected_oom_adj)
+					continue;
+				if (oom_adj == selected_oom_adj &&
+				    tasksize <= selected_tasksize)
+					continue;
+			}
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
 		}
 	}
+	if (selected)
+		get_task_struct(selected);
+	rcu_read_unlock();
+
+	if (selected) {
+		s64 select_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+			     selected->pid, selected->comm,
+			     selected_oom_adj, selected_tasksize);
+		trace_lowmem_kill(selected, selected_oom_adj, selected_tasksize,
+				  level, other_free, other_file, select_ns);
+		lowmem_record_kill(selected, selected_oom_adj,
+				   selected_tasksize, level, select_ns);
+		/*
+		 * Only the task_struct is pinned; the victim may be past
+		 * __exit_signal() already, so go through lock_task_sighand().
+		 */
+		send_sig(SIGKILL, selected, 0);
+		put_task_struct(selected);
+	}
+
+	mutex_unlock(&lowmem_kill_lock);
+	return selected_tasksize;
+}
+
+/*
+ * Kills are started as soon as reclaim notices that free memory is below a
+ * minfree level, instead of waiting for vmscan to ask us to scan.
+ */
+static void lowmem_kill_fn(struct work_struct *work)
+{
+	int other_free, other_file;
+	int level = lowmem_level(&other_free, &other_file);
+
+	if (level < 0)
+		return;
+
+	lowmem_print(3, "lowmem_kill_fn ofree %d %d, ma %d\n",
+		     other_free, other_file, lowmem_adj[level]);
+	lowmem_kill(level, other_free, other_file);
+}
+
+static DECLARE_WORK(lowmem_kill_work, lowmem_kill_fn);
+
+static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+{
+	int rem = 0;
+	int other_free, other_file;
+	int level = lowmem_level(&other_free, &other_file);
+	int min_adj = level < 0 ? OOM_ADJUST_MAX + 1 : lowmem_adj[level];
+
 	if (nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
 			     nr_to_scan, gfp_mask, other_free, other_file,
@@ -124,60 +367,17 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 		global_page_state(NR_ACTIVE_FILE) +
 		global_page_state(NR_INACTIVE_ANON) +
 		global_page_state(NR_INACTIVE_FILE);
-	if (nr_to_scan <= 0 || min_adj == OOM_ADJUST_MAX + 1) {
+	if (nr_to_scan <= 0 || level < 0) {
+		if (level >= 0 && !lowmem_deathpending)
+			schedule_work(&lowmem_kill_work);
 		lowmem_print(5, "lowmem_shrink %d, %x, return %d\n",
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
-
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
-	if (selected) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
-		rem -= selected_tasksize;
-	}
+
+	rem -= lowmem_kill(level, other_free, other_file);
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -186,16 +386,74 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+static int lowmem_stats_show(struct seq_file *m, void *unused)
+{
+	struct lowmem_kill_record *rec;
+	unsigned int i, n;
+
+	spin_lock_irq(&lowmem_stats_lock);
+
+	seq_printf(m, "kills: %lu\n", lowmem_stats.kills);
+	seq_printf(m, "level_kills:");
+	for (i = 0; i < ARRAY_SIZE(lowmem_stats.level_kills); i++)
+		seq_printf(m, " %lu", lowmem_stats.level_kills[i]);
+	seq_printf(m, "\nrss_freed_pages: %lu\n", lowmem_stats.rss_freed);
+	seq_printf(m, "select_ns_total: %lld\n", lowmem_stats.select_ns_total);
+	seq_printf(m, "select_ns_max: %lld\n", lowmem_stats.select_ns_max);
+	seq_printf(m, "deathpending_bails: %lu\n",
+		   lowmem_stats.deathpending_bails);
+	seq_printf(m, "deathpending_timeouts: %lu\n",
+		   lowmem_stats.deathpending_timeouts);
+
+	seq_printf(m, "kill_latency_ms:\n");
+	for (i = 0; i < LOWMEM_LATENCY_BUCKETS - 1; i++)
+		seq_printf(m, "  <%u: %lu\n", 1 << i, lowmem_stats.latency[i]);
+	seq_printf(m, "  >=%u: %lu\n", 1 << i, lowmem_stats.latency[i]);
+
+	seq_printf(m, "recent_kills:\n");
+	seq_printf(m, "  pid comm adj level pages select_ns exit_ns\n");
+	n = min_t(unsigned int, lowmem_stats.recent_next, LOWMEM_RECENT_KILLS);
+	for (i = 0; i < n; i++) {
+		rec = &lowmem_stats.recent[(lowmem_stats.recent_next - n + i) %
+					   LOWMEM_RECENT_KILLS];
+		seq_printf(m, "  %d %s %d %d %d %lld %lld\n", rec->pid,
+			   rec->comm, rec->oom_adj, rec->level, rec->tasksize,
+			   rec->select_ns, rec->exit_ns);
+	}
+
+	spin_unlock_irq(&lowmem_stats_lock);
+
+	return 0;
+}
+
+static int lowmem_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lowmem_stats_show, NULL);
+}
+
+static const struct file_operations lowmem_stats_fops = {
+	.open = lowmem_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct dentry *lowmem_debugfs;
+
 static int __init lowmem_init(void)
 {
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
+	lowmem_debugfs = debugfs_create_file("lowmemorykiller", S_IRUGO, NULL,
+					     NULL, &lowmem_stats_fops);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	debugfs_remove(lowmem_debugfs);
 	unregister_shrinker(&lowmem_shrinker);
+	cancel_work_sync(&lowmem_kill_work);
 	task_free_unregister(&task_nb);
 }
 
@@ -0,0 +1,79 @@
+/*
+ * Compression streams for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+
+/*
+ * A compression stream is the working memory and output buffer needed to
+ * compress one page.  Each device keeps a pool of them so that several
+ * writers can compress at the same time.
+ */
+struct zcomp_strm {
+	/* compressed page, two pages long since it may expand */
+	void *buffer;
+	/* backend private data, such as working memory */
+	void *private;
+	struct list_head list;
+};
+
+/*
+ * A compression algorithm.  create() is called for every stream, from
+ * process context.  compress() and decompress() must not sleep.
+ */
+struct zcomp_backend {
+	int (*compress)(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private);
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, void *private);
+	void *(*create)(void);
+	void (*destroy)(void *private);
+	const char *name;
+	/* decompress() uses the stream's private data */
+	int decompress_needs_strm;
+};
+
+struct zcomp {
+	spinlock_t strm_lock;	/* protects the fields below */
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;
+	int avail_strm;		/* streams allocated, idle or busy */
+	int max_strm;
+	u64 num_waits;		/* writers that had to wait for a stream */
+	u64 wait_time;		/* total time spent waiting, in ns */
+	struct zcomp_backend *backend;
+};
+
+ssize_t zcomp_available_show(const char *comp, char *buf);
+int zcomp_available_algorithm(const char *comp);
+
+struct zcomp *zcomp_create(const char *compress, int max_strm);
+void zcomp_destroy(struct zcomp *comp);
+int zcomp_set_max_streams(struct zcomp *comp, int num_strm);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len);
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t src_len, unsigned char *dst);
+
+static inline int zcomp_decompress_needs_strm(struct zcomp *comp)
+{
+	return comp->backend->decompress_needs_strm;
+}
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/zlib.h>
+
+#include "zcomp_zlib.h"
+
+/*
+ * Raw deflate, as used by crypto/deflate.c.  A 4KB window is enough
+ * since every page is compressed on its own.
+ */
+#define ZLIB_LEVEL	Z_DEFAULT_COMPRESSION
+#define ZLIB_WINBITS	12
+#define ZLIB_MEMLEVEL	MAX_MEM_LEVEL
+
+struct zlib_ctx {
+	struct z_stream_s comp_stream;
+	struct z_stream_s decomp_stream;
+};
+
+static void zlib_destroy(void *private)
+{
+	struct zlib_ctx *ctx = private;
+
+	if (ctx->comp_stream.workspace) {
+		zlib_deflateEnd(&ctx->comp_stream);
+		vfree(ctx->comp_stream.workspace);
+	}
+	if (ctx->decomp_stream.workspace) {
+		zlib_inflateEnd(&ctx->decomp_stream);
+		vfree(ctx->decomp_stream.workspace);
+	}
+	kfree(ctx);
+}
+
+static void *zlib_create(void)
+{
+	struct zlib_ctx *ctx;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return NULL;
+
+	ctx->comp_stream.workspace = vzalloc(zlib_deflate_workspacesize());
+	if (!ctx->comp_stream.workspace)
+		goto fail;
+	if (zlib_deflateInit2(&ctx->comp_stream, ZLIB_LEVEL, Z_DEFLATED,
+			-ZLIB_WINBITS, ZLIB_MEMLEVEL,
+			Z_DEFAULT_STRATEGY) != Z_OK) {
+		vfree(ctx->comp_stream.workspace);
+		ctx->comp_stream.workspace = NULL;
+		goto fail;
+	}
+
+	ctx->decomp_stream.workspace = vzalloc(zlib_inflate_workspacesize());
+	if (!ctx->decomp_stream.workspace)
+		goto fail;
+	if (zlib_inflateInit2(&ctx->decomp_stream, -ZLIB_WINBITS) != Z_OK) {
+		vfree(ctx->decomp_stream.workspace);
+		ctx->decomp_stream.workspace = NULL;
+		goto fail;
+	}
+
+	return ctx;
+
+fail:
+	zlib_destroy(ctx);
+	return NULL;
+}
+
+static int zlib_compress(const unsigned char *src, unsigned char *dst,
+		size_t *dst_len, void *private)
+{
+	struct zlib_ctx *ctx = private;
+	struct z_stream_s *stream = &ctx->comp_stream;
+
+	if (zlib_deflateReset(stream) != Z_OK)
+		return -EINVAL;
+
+	stream->next_in = src;
+	stream->avail_in = PAGE_SIZE;
+	stream->next_out = dst;
+	stream->avail_out = PAGE_SIZE * 2;
+
+	if (zlib_deflate(stream, Z_FINISH) != Z_STREAM_END)
+		return -EINVAL;
+
+	*dst_len = stream->total_out;
+	return 0;
+}
+
+static int zlib_decompress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, void *private)
+{
+	struct zlib_ctx *ctx = private;
+	struct z_stream_s *stream = &ctx->decomp_stream;
+	int ret;
+
+	if (zlib_inflateReset(stream) != Z_OK)
+		return -EINVAL;
+
+	stream->next_in = src;
+	stream->avail_in = src_len;
+	stream->next_out = dst;
+	stream->avail_out = PAGE_SIZE;
+
+	ret = zlib_inflate(stream, Z_SYNC_FLUSH);
+	/* Raw deflate may want to taste an extra byte, see crypto/deflate.c */
+	if (ret == Z_OK && !stream->avail_in && stream->avail_out) {
+		u8 zerostuff = 0;
+
+		stream->next_in = &zerostuff;
+		stream->avail_in = 1;
+		ret = zlib_inflate(stream, Z_FINISH);
+	}
+	if (ret != Z_STREAM_END || stream->total_out != PAGE_SIZE)
+		return -EINVAL;
+
+	return 0;
+}
+
+struct zcomp_backend zcomp_zlib = {
+	.compress = zlib_compress,
+	.decompress = zlib_decompress,
+	.create = zlib_create,
+	.destroy = zlib_destroy,
+	.name = "deflate",
+	.decompress_needs_strm = 1,
+};
@@ -18,7 +18,9 @@
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
 
-#include "xvmalloc.h"
+#include "zcomp.h"
+#include "zram_dedup.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,20 +28,11 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
+/* Compression backend used unless comp_algorithm is set */
+static const char default_compressor[] = "lzo";
+
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
@@ -50,9 +43,8 @@ static const unsigned default_disksize_perc_ram = 25;
 static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
- * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ * NOTE: max_zpage_size must be less than or equal to the largest
+ * object zs_malloc() can allocate, otherwise it would always fail.
  */
 
 /*-- End of configurable params */
@@ -67,8 +59,17 @@ enum zram_pageflags {
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/*
+	 * Page consists of one repeated word, which is kept in the
+	 * table entry's handle instead of any allocated memory
+	 */
+	ZRAM_SAME,
+
+	/* Page lives on the backing device; handle is the block index */
+	ZRAM_WB,
+
+	/* Page is being written back; cleared if the page is freed */
+	ZRAM_UNDER_WB,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -77,10 +78,16 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	/*
+	 * zsmalloc handle (struct zram_entry * with dedup), the page itself
+	 * if stored uncompressed, the fill word of a ZRAM_SAME page, or the
+	 * backing device block of a ZRAM_WB page
+	 */
+	unsigned long handle;
+	u16 size;	/* compressed size */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
+	u32 ac_time;	/* last access, in seconds since boot */
 } __attribute__((aligned(4)));
 
 struct zram_stats {
@@ -91,20 +98,24 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 dup_size;		/* compressed bytes shared through dedup */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* no. of same filled pages, incl. zero */
+	u32 pages_dup;		/* no. of pages sharing another's object */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 bd_pages;		/* no. of pages on the backing device */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zcomp *comp;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	rwlock_t tb_lock;	/* protect table entries and 32-bit stats */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -115,6 +126,16 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	int max_comp_streams;
+	char compressor[10];	/* name of the zcomp backend */
+	int use_dedup;		/* share identical compressed objects */
+	struct zram_hash *hash;	/* dedup index */
+	size_t hash_size;
+	/* Backing device for writeback, set through sysfs before init */
+	struct block_device *bdev;
+	char *backing_path;
+	unsigned long *bitmap;	/* blocks in use on bdev */
+	unsigned long nr_blocks;
 
 	struct zram_stats stats;
 };
@@ -127,5 +148,8 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_reset_backing_dev(struct zram *zram);
+extern int zram_writeback(struct zram *zram, int huge, unsigned long idle);
 
 #endif
@@ -0,0 +1,601 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Objects are grouped by size into classes.  Each class packs its objects
+ * into zspages of one to four pages, chosen to waste the least space for
+ * that object size.  Callers refer to objects by handle, which lets
+ * zs_compact() move objects out of sparsely used zspages and free them.
+ * That matters for zram, whose objects are freed in random order and
+ * would otherwise leave most zspages partly empty after a long uptime.
+ */
+
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static struct kmem_cache *zs_handle_cachep;
+static struct dentry *zs_stat_root;
+
+static unsigned int get_size_class_index(size_t size)
+{
+	if (size <= ZS_MIN_ALLOC_SIZE)
+		return 0;
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/* Pick the zspage size that wastes the least space for this class */
+static unsigned int get_pages_per_zspage(unsigned int class_size)
+{
+	unsigned int i, best = 1, max_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		unsigned int zspage_size = i * PAGE_SIZE;
+		unsigned int waste = zspage_size % class_size;
+		unsigned int usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Copy len bytes between buf and the start of slot obj_idx of zspage,
+ * splitting the copy where the slot crosses a page boundary.
+ */
+static void zs_copy_obj(struct size_class *class, struct zspage *zspage,
+			unsigned int obj_idx, void *buf, size_t len, int write)
+{
+	unsigned long off = (unsigned long)obj_idx * class->size;
+
+	while (len) {
+		unsigned int poff = off & ~PAGE_MASK;
+		size_t n = min_t(size_t, len, PAGE_SIZE - poff);
+		void *addr;
+
+		addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], KM_USER1);
+		if (write)
+			memcpy(addr + poff, buf, n);
+		else
+			memcpy(buf, addr + poff, n);
+		kunmap_atomic(addr, KM_USER1);
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+}
+
+static void free_zspage(struct zs_pool *pool, struct size_class *class,
+			struct zspage *zspage)
+{
+	unsigned int i;
+
+	for (i = 0; i < class->pages_per_zspage; i++)
+		__free_page(zspage->pages[i]);
+	atomic_long_sub(class->pages_per_zspage, &pool->pages_allocated);
+	kfree(zspage);
+}
+
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+				struct size_class *class, gfp_t flags)
+{
+	struct zspage *zspage;
+	unsigned int i;
+
+	zspage = kzalloc(sizeof(*zspage), flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(flags);
+		if (!zspage->pages[i]) {
+			while (i--)
+				__free_page(zspage->pages[i]);
+			kfree(zspage);
+			return NULL;
+		}
+	}
+	atomic_long_add(class->pages_per_zspage, &pool->pages_allocated);
+
+	return zspage;
+}
+
+/* Take a free slot of zspage for handle.  Called with class->lock held. */
+static void obj_alloc(struct size_class *class, struct zspage *zspage,
+			struct zs_handle *handle)
+{
+	unsigned int obj_idx;
+
+	obj_idx = find_first_zero_bit(zspage->used, class->objs_per_zspage);
+	BUG_ON(obj_idx >= class->objs_per_zspage);
+	__set_bit(obj_idx, zspage->used);
+	if (++zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->full);
+	class->objs_inuse++;
+
+	handle->zspage = zspage;
+	handle->obj_idx = obj_idx;
+}
+
+/*
+ * Release slot obj_idx of zspage.  Returns true if the zspage is now
+ * empty; it is then off the class lists and the caller must free it.
+ * Called with class->lock held.
+ */
+static bool obj_free(struct size_class *class, struct zspage *zspage,
+			unsigned int obj_idx)
+{
+	BUG_ON(!test_bit(obj_idx, zspage->used));
+	__clear_bit(obj_idx, zspage->used);
+	class->objs_inuse--;
+
+	if (zspage->inuse-- == class->objs_per_zspage)
+		list_move(&zspage->list, &class->partial);
+	if (zspage->inuse)
+		return false;
+
+	list_del(&zspage->list);
+	class->zspages--;
+	return true;
+}
+
+/**
+ * zs_malloc - Allocate an object of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of object to allocate
+ * @flags: flags for the page and metadata allocations
+ *
+ * Returns a handle to the object, or 0 on failure.  The object has to be
+ * mapped with zs_map_object() to be accessed.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	struct zs_handle *handle;
+	struct size_class *class;
+	struct zspage *zspage;
+	unsigned long h;
+
+	if (unlikely(!size || size + ZS_HANDLE_SIZE > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	handle = kmem_cache_alloc(zs_handle_cachep, flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+	h = (unsigned long)handle;
+
+	handle->class_idx = get_size_class_index(size + ZS_HANDLE_SIZE);
+	class = &pool->size_class[handle->class_idx];
+
+	spin_lock(&class->lock);
+	if (list_empty(&class->partial)) {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(pool, class, flags);
+		if (!zspage) {
+			kmem_cache_free(zs_handle_cachep, handle);
+			return 0;
+		}
+		spin_lock(&class->lock);
+		list_add(&zspage->list, &class->partial);
+		class->zspages++;
+	}
+
+	zspage = list_first_entry(&class->partial, struct zspage, list);
+	obj_alloc(class, zspage, handle);
+	zs_copy_obj(class, zspage, handle->obj_idx, &h, ZS_HANDLE_SIZE, 1);
+	spin_unlock(&class->lock);
+
+	return h;
+}
+
+void zs_free(struct zs_pool *pool, unsigned long h)
+{
+	struct zs_handle *handle = (struct zs_handle *)h;
+	struct size_class *class = &pool->size_class[handle->class_idx];
+	struct zspage *zspage;
+	bool empty;
+
+	spin_lock(&class->lock);
+	zspage = handle->zspage;
+	empty = obj_free(class, zspage, handle->obj_idx);
+	spin_unlock(&class->lock);
+
+	if (empty)
+		free_zspage(pool, class, zspage);
+	kmem_cache_free(zs_handle_cachep, handle);
+}
+
+/**
+ * zs_map_object - get a pointer to the object behind a handle
+ * @pool: pool the object was allocated from
+ * @h: handle returned by zs_malloc()
+ * @mm: whether the object will be read or written
+ *
+ * The object cannot move until zs_unmap_object(), and the caller must not
+ * sleep or map another object in between.  Compaction skips the zspage in
+ * the meantime, but other objects of the class can be mapped, allocated
+ * and freed.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long h,
+			enum zs_mapmode mm)
+{
+	struct zs_handle *handle = (struct zs_handle *)h;
+	struct size_class *class = &pool->size_class[handle->class_idx];
+	struct zs_map_area *area;
+	struct zspage *zspage;
+	unsigned long off;
+	unsigned int poff;
+
+	spin_lock(&class->lock);
+	zspage = handle->zspage;
+	zspage->mapped++;
+	spin_unlock(&class->lock);
+
+	area = get_cpu_ptr(pool->map_area);
+	area->mm = mm;
+
+	off = (unsigned long)handle->obj_idx * class->size;
+	poff = off & ~PAGE_MASK;
+	if (poff + class->size <= PAGE_SIZE) {
+		area->kaddr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT],
+					KM_USER1);
+		return area->kaddr + poff + ZS_HANDLE_SIZE;
+	}
+
+	area->kaddr = NULL;
+	if (mm == ZS_MM_RO)
+		zs_copy_obj(class, zspage, handle->obj_idx,
+				area->buf, class->size, 0);
+	else
+		*(unsigned long *)area->buf = h;
+	return area->buf + ZS_HANDLE_SIZE;
+}
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long h)
+{
+	struct zs_handle *handle = (struct zs_handle *)h;
+	struct size_class *class = &pool->size_class[handle->class_idx];
+	struct zs_map_area *area = this_cpu_ptr(pool->map_area);
+	struct zspage *zspage = handle->zspage;
+
+	if (area->kaddr)
+		kunmap_atomic(area->kaddr, KM_USER1);
+	else if (area->mm == ZS_MM_WO)
+		zs_copy_obj(class, zspage, handle->obj_idx,
+				area->buf, class->size, 1);
+	area->kaddr = NULL;
+	put_cpu_ptr(pool->map_area);
+
+	spin_lock(&class->lock);
+	zspage->mapped--;
+	spin_unlock(&class->lock);
+}
+
+/*
+ * The unmapped zspage with the fewest objects in use, provided the other
+ * partial zspages have room for all of them.  Called with class->lock held.
+ */
+static struct zspage *find_source_zspage(struct size_class *class)
+{
+	struct zspage *zspage, *src = NULL;
+	unsigned long free_objs = 0;
+
+	list_for_each_entry(zspage, &class->partial, list) {
+		free_objs += class->objs_per_zspage - zspage->inuse;
+		if (zspage->mapped)
+			continue;
+		if (!src || zspage->inuse < src->inuse)
+			src = zspage;
+	}
+	if (!src)
+		return NULL;
+
+	free_objs -= class->objs_per_zspage - src->inuse;
+	return free_objs >= src->inuse ? src : NULL;
+}
+
+/* The fullest partial zspage other than src */
+static struct zspage *find_dest_zspage(struct size_class *class,
+					struct zspage *src)
+{
+	struct zspage *zspage, *dst = NULL;
+
+	list_for_each_entry(zspage, &class->partial, list) {
+		if (zspage != src && (!dst || zspage->inuse > dst->inuse))
+			dst = zspage;
+	}
+
+	return dst;
+}
+
+/*
+ * Move all objects out of src, filling one destination zspage before
+ * looking for the next.  Called with class->lock held.
+ */
+static void migrate_zspage(struct zs_pool *pool, struct size_class *class,
+			struct zspage *src)
+{
+	char *buf = this_cpu_ptr(pool->map_area)->buf;
+	struct zspage *dst = NULL;
+	unsigned int obj_idx;
+
+	for_each_set_bit(obj_idx, src->used, class->objs_per_zspage) {
+		struct zs_handle *handle;
+
+		if (!dst || dst->inuse == class->objs_per_zspage)
+			dst = find_dest_zspage(class, src);
+		BUG_ON(!dst);
+		zs_copy_obj(class, src, obj_idx, buf, class->size, 0);
+		handle = *(struct zs_handle **)buf;
+		BUG_ON(handle->zspage != src || handle->obj_idx != obj_idx);
+
+		obj_free(class, src, obj_idx);
+		obj_alloc(class, dst, handle);
+		zs_copy_obj(class, dst, handle->obj_idx, buf, class->size, 1);
+	}
+}
+
+/* Compact class until at least max_pages are freed or nothing is left */
+static unsigned long zs_compact_class(struct zs_pool *pool,
+				struct size_class *class,
+				unsigned long max_pages)
+{
+	struct zspage *src;
+	unsigned long freed = 0;
+
+	spin_lock(&class->lock);
+	while (freed < max_pages &&
+	       (src = find_source_zspage(class)) != NULL) {
+		migrate_zspage(pool, class, src);
+		class->pages_compacted += class->pages_per_zspage;
+		spin_unlock(&class->lock);
+
+		free_zspage(pool, class, src);
+		freed += class->pages_per_zspage;
+		cond_resched();
+
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - move objects to free as many zspages as possible
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	unsigned long freed = 0;
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		freed += zs_compact_class(pool, &pool->size_class[i],
+					  ULONG_MAX);
+
+	return freed;
+}
+
+/* Pages compaction could free if objects were packed perfectly */
+static unsigned long zs_compactable_pages(struct zs_pool *pool)
+{
+	unsigned long pages = 0;
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+		unsigned long free_objs;
+
+		free_objs = class->zspages * class->objs_per_zspage -
+				class->objs_inuse;
+		pages += free_objs / class->objs_per_zspage *
+				class->pages_per_zspage;
+	}
+
+	return pages;
+}
+
+static int zs_shrink(struct shrinker *shrinker, int nr_to_scan,
+			gfp_t gfp_mask)
+{
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+						shrinker);
+	unsigned long freed = 0;
+	int i;
+
+	if (!nr_to_scan)
+		return zs_compactable_pages(pool);
+
+	/* zram allocates with GFP_NOIO while it has I/O in flight */
+	if (!(gfp_mask & __GFP_IO))
+		return -1;
+
+	/* Free about nr_to_scan pages, going round the classes in turn */
+	for (i = 0; i < ZS_SIZE_CLASSES && freed < nr_to_scan; i++) {
+		int idx = pool->shrink_class;
+
+		freed += zs_compact_class(pool, &pool->size_class[idx],
+					  nr_to_scan - freed);
+		if (freed < nr_to_scan)
+			pool->shrink_class = (idx + 1) % ZS_SIZE_CLASSES;
+	}
+
+	return zs_compactable_pages(pool);
+}
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+
+static int zs_stats_show(struct seq_file *m, void *unused)
+{
+	struct zs_pool *pool = m->private;
+	int i;
+
+	seq_printf(m, "%5s %5s %6s %10s %10s %8s %10s\n", "class", "size",
+		"pages", "obj_used", "obj_alloc", "zspages", "compacted");
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+		unsigned long zspages, objs_inuse, compacted;
+
+		spin_lock(&class->lock);
+		zspages = class->zspages;
+		objs_inuse = class->objs_inuse;
+		compacted = class->pages_compacted;
+		spin_unlock(&class->lock);
+
+		if (!zspages && !compacted)
+			continue;
+
+		seq_printf(m, "%5d %5u %6lu %10lu %10lu %8lu %10lu\n",
+			i, class->size, zspages * class->pages_per_zspage,
+			objs_inuse, zspages * class->objs_per_zspage,
+			zspages, compacted);
+	}
+
+	return 0;
+}
+
+static int zs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_stats_show, inode->i_private);
+}
+
+static const struct file_operations zs_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = zs_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void zs_free_map_areas(struct zs_pool *pool)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(pool->map_area, cpu)->buf);
+	free_percpu(pool->map_area);
+}
+
+/*
+ * Create a memory pool. name is used for the debugfs stats file, which
+ * shows how full the zspages of every size class are.
+ */
+struct zs_pool *zs_create_pool(const char *name)
+{
+	struct zs_pool *pool;
+	int i, cpu;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	pool->name = kstrdup(name, GFP_KERNEL);
+	if (!pool->name)
+		goto free_pool;
+
+	pool->map_area = alloc_percpu(struct zs_map_area);
+	if (!pool->map_area)
+		goto free_name;
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->map_area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto free_map_areas;
+	}
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock_init(&class->lock);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE /
+						class->size;
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+	}
+	atomic_long_set(&pool->pages_allocated, 0);
+
+	if (zs_stat_root)
+		pool->stat_dentry = debugfs_create_file(pool->name, S_IRUGO,
+					zs_stat_root, pool, &zs_stats_fops);
+
+	pool->shrinker.shrink = zs_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	return pool;
+
+free_map_areas:
+	zs_free_map_areas(pool);
+free_name:
+	kfree(pool->name);
+free_pool:
+	kfree(pool);
+	return NULL;
+}
+
+/* All objects must have been freed */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i;
+
+	unregister_shrinker(&pool->shrinker);
+	debugfs_remove(pool->stat_dentry);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		if (class->zspages)
+			pr_info("zsmalloc: %s: class %d has %lu zspages left\n",
+				pool->name, i, class->zspages);
+	}
+
+	zs_free_map_areas(pool);
+	kfree(pool->name);
+	kfree(pool);
+}
+
+int zs_init(void)
+{
+	zs_handle_cachep = kmem_cache_create("zs_handle",
+				sizeof(struct zs_handle), 0, 0, NULL);
+	if (!zs_handle_cachep)
+		return -ENOMEM;
+
+	zs_stat_root = debugfs_create_dir("zsmalloc", NULL);
+	return 0;
+}
+
+void zs_exit(void)
+{
+	debugfs_remove(zs_stat_root);
+	kmem_cache_destroy(zs_handle_cachep);
+}
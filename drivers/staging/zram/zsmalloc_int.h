@@ -0,0 +1,100 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/*
+ * Every object starts with the handle that refers to it, so that
+ * compaction can find and update the handle when it moves the object.
+ */
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
+/* Smallest and largest slot, including the handle */
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/*
+ * Slot sizes go up in steps of ZS_SIZE_CLASS_DELTA.  Slots are 16 byte
+ * aligned, so the handle never straddles a page boundary.
+ */
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / \
+					ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * A zspage is a group of up to ZS_MAX_PAGES_PER_ZSPAGE pages holding
+ * objects of one size class.  Objects may straddle the pages of a zspage,
+ * which lets large classes waste much less than one object per page would.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+#define ZS_MAX_OBJS_PER_ZSPAGE	(ZS_MAX_PAGES_PER_ZSPAGE * PAGE_SIZE / \
+					ZS_MIN_ALLOC_SIZE)
+
+struct zspage {
+	struct list_head list;	/* in class->partial or class->full */
+	unsigned int inuse;
+	unsigned int mapped;	/* objects mapped; compaction leaves it be */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	DECLARE_BITMAP(used, ZS_MAX_OBJS_PER_ZSPAGE);
+};
+
+/* What a handle points to.  Only compaction changes it. */
+struct zs_handle {
+	struct zspage *zspage;
+	u16 class_idx;
+	u16 obj_idx;
+};
+
+struct size_class {
+	spinlock_t lock;	/* protects everything in the class */
+	unsigned int size;	/* slot size, including the handle */
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+
+	/* zspages with free slots; empty zspages are freed right away */
+	struct list_head partial;
+	struct list_head full;
+
+	/* stats */
+	unsigned long zspages;
+	unsigned long objs_inuse;
+	unsigned long pages_compacted;
+};
+
+/*
+ * Objects that straddle two pages are copied through a per-cpu buffer
+ * while they are mapped.  The buffer is also used by compaction, which
+ * holds class->lock; mapping holds it only to pin the zspage.
+ */
+struct zs_map_area {
+	char *buf;
+	void *kaddr;		/* set if the object was mapped directly */
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	char *name;
+	struct zs_map_area __percpu *map_area;
+	atomic_long_t pages_allocated;
+	struct shrinker shrinker;
+	int shrink_class;	/* class zs_shrink() compacts next */
+	struct dentry *stat_dentry;
+
+	struct size_class size_class[ZS_SIZE_CLASSES];
+};
+
+#endif
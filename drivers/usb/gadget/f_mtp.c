@@ -28,8 +28,10 @@
 
 #include <linux/types.h>
 #include <linux/file.h>
+#include <linux/fs.h>
 #include <linux/device.h>
 #include <linux/miscdevice.h>
+#include <linux/writeback.h>
 
 #include <linux/usb.h>
 #include <linux/usb_usual.h>
@@ -51,8 +53,20 @@
 #define STATE_ERROR                 4   /* error from completion routine */
 
 /* number of tx and rx requests to allocate */
-#define TX_REQ_MAX 4
-#define RX_REQ_MAX 2
+#define TX_REQ_MAX 16
+#define RX_REQ_MAX 16
+
+/* Size and number of bulk requests, read at bind time.  Requests are
+ * halved down to BULK_BUFFER_SIZE if the larger buffers cannot be had.
+ */
+static unsigned int mtp_tx_req_len = 65536;
+module_param(mtp_tx_req_len, uint, S_IRUGO | S_IWUSR);
+static unsigned int mtp_tx_reqs = 4;
+module_param(mtp_tx_reqs, uint, S_IRUGO | S_IWUSR);
+static unsigned int mtp_rx_req_len = 65536;
+module_param(mtp_rx_req_len, uint, S_IRUGO | S_IWUSR);
+static unsigned int mtp_rx_reqs = 4;
+module_param(mtp_rx_reqs, uint, S_IRUGO | S_IWUSR);
 
 /* ID for Microsoft MTP OS String */
 #define MTP_OS_STRING_ID   0xEE
@@ -96,6 +110,13 @@ struct mtp_dev {
 	struct usb_request *rx_req[RX_REQ_MAX];
 	struct usb_request *intr_req;
 	int rx_done;
+	/* rx requests completed during receive_file_work */
+	atomic_t rx_completed;
+
+	int tx_req_len;
+	int tx_reqs;
+	int rx_req_len;
+	int rx_reqs;
 	/* true if interrupt endpoint is busy */
 	int intr_busy;
 
@@ -369,6 +390,18 @@ static void mtp_complete_out(struct usb_ep *ep, struct usb_request *req)
 	wake_up(&dev->read_wq);
 }
 
+static void mtp_complete_receive(struct usb_ep *ep, struct usb_request *req)
+{
+	struct mtp_dev *dev = _mtp_dev;
+
+	/* requests dequeued at the end of a transfer are not an error */
+	if (req->status != 0 && req->status != -ECONNRESET)
+		dev->state = STATE_ERROR;
+	atomic_inc(&dev->rx_completed);
+
+	wake_up(&dev->read_wq);
+}
+
 static void mtp_complete_intr(struct usb_ep *ep, struct usb_request *req)
 {
 	struct mtp_dev *dev = _mtp_dev;
@@ -430,17 +463,38 @@ static int __init create_bulk_endpoints(struct mtp_dev *dev,
 	dev->ep_intr = ep;
 
 	/* now allocate requests for our endpoints */
-	for (i = 0; i < TX_REQ_MAX; i++) {
-		req = mtp_request_new(dev->ep_in, BULK_BUFFER_SIZE);
-		if (!req)
-			goto fail;
+	dev->tx_req_len = max_t(int, mtp_tx_req_len & ~511, BULK_BUFFER_SIZE);
+	dev->tx_reqs = clamp_t(int, mtp_tx_reqs, 1, TX_REQ_MAX);
+retry_tx_alloc:
+	for (i = 0; i < dev->tx_reqs; i++) {
+		req = mtp_request_new(dev->ep_in, dev->tx_req_len);
+		if (!req) {
+			if (dev->tx_req_len <= BULK_BUFFER_SIZE)
+				goto fail;
+			while ((req = req_get(dev, &dev->tx_idle)))
+				mtp_request_free(req, dev->ep_in);
+			dev->tx_req_len = max(dev->tx_req_len / 2,
+					BULK_BUFFER_SIZE);
+			goto retry_tx_alloc;
+		}
 		req->complete = mtp_complete_in;
 		req_put(dev, &dev->tx_idle, req);
 	}
-	for (i = 0; i < RX_REQ_MAX; i++) {
-		req = mtp_request_new(dev->ep_out, BULK_BUFFER_SIZE);
-		if (!req)
-			goto fail;
+
+	dev->rx_req_len = max_t(int, mtp_rx_req_len & ~511, BULK_BUFFER_SIZE);
+	dev->rx_reqs = clamp_t(int, mtp_rx_reqs, 1, RX_REQ_MAX);
+retry_rx_alloc:
+	for (i = 0; i < dev->rx_reqs; i++) {
+		req = mtp_request_new(dev->ep_out, dev->rx_req_len);
+		if (!req) {
+			if (dev->rx_req_len <= BULK_BUFFER_SIZE)
+				goto fail;
+			while (i--)
+				mtp_request_free(dev->rx_req[i], dev->ep_out);
+			dev->rx_req_len = max(dev->rx_req_len / 2,
+					BULK_BUFFER_SIZE);
+			goto retry_rx_alloc;
+		}
 		req->complete = mtp_complete_out;
 		dev->rx_req[i] = req;
 	}
@@ -468,7 +522,7 @@ static ssize_t mtp_read(struct file *fp, char __user *buf,
 
 	DBG(cdev, "mtp_read(%d)\n", count);
 
-	if (count > BULK_BUFFER_SIZE)
+	if (count > dev->rx_req_len)
 		return -EINVAL;
 
 	/* we will block until we're online */
@@ -493,6 +547,7 @@ requeue_req:
 	/* queue a request */
 	req = dev->rx_req[0];
 	req->length = count;
+	req->complete = mtp_complete_out;
 	dev->rx_done = 0;
 	ret = usb_ep_queue(dev->ep_out, req, GFP_KERNEL);
 	if (ret < 0) {
@@ -587,8 +642,8 @@ static ssize_t mtp_write(struct file *fp, const char __user *buf,
 			break;
 		}
 
-		if (count > BULK_BUFFER_SIZE)
-			xfer = BULK_BUFFER_SIZE;
+		if (count > dev->tx_req_len)
+			xfer = dev->tx_req_len;
 		else
 			xfer = count;
 		if (xfer && copy_from_user(req->buf, buf, xfer)) {
@@ -652,6 +707,14 @@ static void send_file_work(struct work_struct *data) {
 		sendZLP = 1;
 	}
 
+	/* The file is read front to back, one request at a time while the
+	 * others are on the wire: read ahead at least a pipeline's worth.
+	 */
+	spin_lock(&filp->f_lock);
+	filp->f_ra.ra_pages = max_t(unsigned int, filp->f_ra.ra_pages,
+		(dev->tx_req_len * dev->tx_reqs) >> PAGE_SHIFT);
+	spin_unlock(&filp->f_lock);
+
 	while (count > 0 || sendZLP) {
 		/* so we exit after sending ZLP */
 		if (count == 0)
@@ -671,8 +734,8 @@ static void send_file_work(struct work_struct *data) {
 			break;
 		}
 
-		if (count > BULK_BUFFER_SIZE)
-			xfer = BULK_BUFFER_SIZE;
+		if (count > dev->tx_req_len)
+			xfer = dev->tx_req_len;
 		else
 			xfer = count;
 		ret = vfs_read(filp, req->buf, xfer, &offset);
@@ -711,11 +774,12 @@ static void receive_file_work(struct work_struct *data)
 {
 	struct mtp_dev	*dev = container_of(data, struct mtp_dev, receive_file_work);
 	struct usb_composite_dev *cdev = dev->cdev;
-	struct usb_request *read_req = NULL, *write_req = NULL;
+	struct usb_request *req;
 	struct file *filp;
-	loff_t offset;
-	int64_t count;
-	int ret, cur_buf = 0;
+	loff_t offset, flushed;
+	int64_t count, unqueued;
+	int ret, i, depth;
+	int head = 0, pending = 0, completed = 0;
 	int r = 0;
 
 	/* read our parameters */
@@ -726,62 +790,85 @@ static void receive_file_work(struct work_struct *data)
 
 	DBG(cdev, "receive_file_work(%lld)\n", count);
 
-	while (count > 0 || write_req) {
-		if (count > 0) {
-			/* queue a request */
-			read_req = dev->rx_req[cur_buf];
-			cur_buf = (cur_buf + 1) % RX_REQ_MAX;
-
-			read_req->length = (count > BULK_BUFFER_SIZE
-					? BULK_BUFFER_SIZE : count);
-			dev->rx_done = 0;
-			ret = usb_ep_queue(dev->ep_out, read_req, GFP_KERNEL);
+	/* Keep up to rx_reqs requests queued while completed ones are
+	 * written out.  If xfer_file_length is 0xFFFFFFFF we read until we
+	 * get a short packet, and requests queued past it could swallow
+	 * the next command from the host, so only keep one in flight.
+	 */
+	depth = count == 0xFFFFFFFF ? 1 : dev->rx_reqs;
+	unqueued = count;
+	flushed = offset;
+	atomic_set(&dev->rx_completed, 0);
+
+	while (count > 0) {
+		while (pending < depth && unqueued > 0) {
+			req = dev->rx_req[(head + pending) % dev->rx_reqs];
+			req->length = (unqueued > dev->rx_req_len
+					? dev->rx_req_len : unqueued);
+			req->complete = mtp_complete_receive;
+			ret = usb_ep_queue(dev->ep_out, req, GFP_KERNEL);
 			if (ret < 0) {
 				r = -EIO;
 				dev->state = STATE_ERROR;
-				break;
+				goto out;
 			}
+			if (count != 0xFFFFFFFF)
+				unqueued -= req->length;
+			pending++;
 		}
 
-		if (write_req) {
-			DBG(cdev, "rx %p %d\n", write_req, write_req->actual);
-			ret = vfs_write(filp, write_req->buf, write_req->actual,
-				&offset);
-			DBG(cdev, "vfs_write %d\n", ret);
-			if (ret != write_req->actual) {
-				r = -EIO;
-				dev->state = STATE_ERROR;
-				break;
-			}
-			write_req = NULL;
+		/* wait for the oldest request, they complete in order */
+		req = dev->rx_req[head];
+		ret = wait_event_interruptible(dev->read_wq,
+			atomic_read(&dev->rx_completed) != completed
+			|| dev->state != STATE_BUSY);
+		if (dev->state == STATE_CANCELED) {
+			r = -ECANCELED;
+			break;
+		}
+		if (dev->state != STATE_BUSY) {
+			r = -EIO;
+			break;
+		}
+		completed++;
+		pending--;
+		head = (head + 1) % dev->rx_reqs;
+
+		if (count != 0xFFFFFFFF)
+			count -= req->actual;
+		if (req->actual < req->length) {
+			/* short packet is used to signal EOF for sizes > 4 gig */
+			DBG(cdev, "got short packet\n");
+			count = 0;
 		}
 
-		if (read_req) {
-			/* wait for our last read to complete */
-			ret = wait_event_interruptible(dev->read_wq,
-				dev->rx_done || dev->state != STATE_BUSY);
-			if (dev->state == STATE_CANCELED) {
-				r = -ECANCELED;
-				if (!dev->rx_done)
-					usb_ep_dequeue(dev->ep_out, read_req);
-				break;
-			}
-			/* if xfer_file_length is 0xFFFFFFFF, then we read until
-			 * we get a zero length packet
-			 */
-			if (count != 0xFFFFFFFF)
-				count -= read_req->actual;
-			if (read_req->actual < read_req->length) {
-				/* short packet is used to signal EOF for sizes > 4 gig */
-				DBG(cdev, "got short packet\n");
-				count = 0;
-			}
+		DBG(cdev, "rx %p %d\n", req, req->actual);
+		ret = vfs_write(filp, req->buf, req->actual, &offset);
+		DBG(cdev, "vfs_write %d\n", ret);
+		if (ret != req->actual) {
+			r = -EIO;
+			dev->state = STATE_ERROR;
+			break;
+		}
 
-			write_req = read_req;
-			read_req = NULL;
+		/* start writeback behind us rather than leaving it all to
+		 * dirty throttling in the middle of the transfer
+		 */
+		if (offset - flushed >= dev->rx_req_len * dev->rx_reqs) {
+			__filemap_fdatawrite_range(filp->f_mapping, flushed,
+				offset - 1, WB_SYNC_NONE);
+			flushed = offset;
 		}
 	}
 
+out:
+	/* give back requests still queued after an error or early EOF */
+	for (i = 0; i < pending; i++)
+		usb_ep_dequeue(dev->ep_out,
+			dev->rx_req[(head + i) % dev->rx_reqs]);
+	wait_event(dev->read_wq,
+		atomic_read(&dev->rx_completed) == completed + pending);
+
 	DBG(cdev, "receive_file_work returning %d\n", r);
 	/* write the result */
 	dev->xfer_result = r;
@@ -1011,7 +1098,7 @@ mtp_function_unbind(struct usb_configuration *c, struct usb_function *f)
 	spin_lock_irq(&dev->lock);
 	while ((req = req_get(dev, &dev->tx_idle)))
 		mtp_request_free(req, dev->ep_in);
-	for (i = 0; i < RX_REQ_MAX; i++)
+	for (i = 0; i < dev->rx_reqs; i++)
 		mtp_request_free(dev->rx_req[i], dev->ep_out);
 	mtp_request_free(dev->intr_req, dev->ep_intr);
 	dev->state = STATE_OFFLINE;
@@ -23,6 +23,9 @@
 
 #include <linux/types.h>
 #include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
 #include <linux/buffer_head.h>
 
 #include "squashfs_fs.h"
@@ -74,3 +77,174 @@ const struct squashfs_decompressor *squashfs_lookup_decompressor(int id)
 
 	return decompressor[i];
 }
+
+
+/*
+ * Decompressor streams.  SINGLE and PERCPU modes pin a reader to one stream
+ * (the only one, or the one of the cpu the reader runs on) and serialise on
+ * its mutex; a reader that migrates while decompressing just keeps it.
+ * MULTI hands out idle streams from a free list, creating new ones on demand
+ * up to max, and makes readers wait for a stream to be returned after that.
+ */
+struct squashfs_stream {
+	struct list_head	list;
+	struct mutex		mutex;
+	void			*strm;
+};
+
+struct squashfs_streams {
+	int			nr;
+	int			max;
+	spinlock_t		lock;
+	struct list_head	free;
+	wait_queue_head_t	wait;
+	struct squashfs_stream	stream[0];
+};
+
+
+int squashfs_decompressor_create(struct squashfs_sb_info *msblk)
+{
+	struct squashfs_streams *streams;
+	int mode = msblk->decomp_mode;
+	int i, max;
+
+	switch (mode) {
+	case SQUASHFS_DECOMP_MULTI:
+		max = 2 * num_online_cpus();
+		break;
+	case SQUASHFS_DECOMP_PERCPU:
+		max = nr_cpu_ids;
+		break;
+	default:
+		max = 1;
+	}
+
+	streams = kzalloc(sizeof(*streams) + max * sizeof(streams->stream[0]),
+		GFP_KERNEL);
+	if (streams == NULL)
+		return -ENOMEM;
+
+	streams->max = max;
+	spin_lock_init(&streams->lock);
+	INIT_LIST_HEAD(&streams->free);
+	init_waitqueue_head(&streams->wait);
+	msblk->stream = streams;
+
+	/* MULTI starts with one stream, the other modes with all of them */
+	streams->nr = mode == SQUASHFS_DECOMP_MULTI ? 1 : max;
+	for (i = 0; i < streams->nr; i++) {
+		mutex_init(&streams->stream[i].mutex);
+		if (mode == SQUASHFS_DECOMP_PERCPU && !cpu_possible(i))
+			continue;
+		streams->stream[i].strm = squashfs_decompressor_init(msblk);
+		if (streams->stream[i].strm == NULL)
+			goto failed;
+		if (mode == SQUASHFS_DECOMP_MULTI)
+			list_add(&streams->stream[i].list, &streams->free);
+	}
+
+	return 0;
+
+failed:
+	squashfs_decompressor_destroy(msblk);
+	return -ENOMEM;
+}
+
+
+void squashfs_decompressor_destroy(struct squashfs_sb_info *msblk)
+{
+	struct squashfs_streams *streams = msblk->stream;
+	int i;
+
+	if (streams == NULL)
+		return;
+
+	for (i = 0; i < streams->nr; i++)
+		if (streams->stream[i].strm)
+			squashfs_decompressor_free(msblk,
+				streams->stream[i].strm);
+	kfree(streams);
+	msblk->stream = NULL;
+}
+
+
+int squashfs_max_decompressors(struct squashfs_sb_info *msblk)
+{
+	return msblk->stream->max;
+}
+
+
+static struct squashfs_stream *get_stream(struct squashfs_sb_info *msblk,
+	struct squashfs_streams *streams)
+{
+	struct squashfs_stream *stream;
+
+	while (1) {
+		spin_lock(&streams->lock);
+		if (!list_empty(&streams->free)) {
+			stream = list_first_entry(&streams->free,
+				struct squashfs_stream, list);
+			list_del(&stream->list);
+			spin_unlock(&streams->lock);
+			return stream;
+		}
+
+		if (streams->nr < streams->max) {
+			stream = &streams->stream[streams->nr++];
+			spin_unlock(&streams->lock);
+
+			stream->strm = squashfs_decompressor_init(msblk);
+			if (stream->strm)
+				return stream;
+
+			/* Out of memory, make do with the streams we have */
+			spin_lock(&streams->lock);
+			streams->max = streams->nr;
+			spin_unlock(&streams->lock);
+			continue;
+		}
+		spin_unlock(&streams->lock);
+
+		wait_event(streams->wait, !list_empty(&streams->free));
+	}
+}
+
+
+static void put_stream(struct squashfs_streams *streams,
+	struct squashfs_stream *stream)
+{
+	spin_lock(&streams->lock);
+	list_add(&stream->list, &streams->free);
+	spin_unlock(&streams->lock);
+	wake_up(&streams->wait);
+}
+
+
+int squashfs_decompress(struct squashfs_sb_info *msblk, void **buffer,
+	struct buffer_head **bh, int b, int offset, int length, int srclength,
+	int pages)
+{
+	struct squashfs_streams *streams = msblk->stream;
+	struct squashfs_stream *stream;
+	int res;
+
+	if (msblk->decomp_mode == SQUASHFS_DECOMP_MULTI) {
+		stream = get_stream(msblk, streams);
+		res = msblk->decompressor->decompress(msblk, stream->strm,
+			buffer, bh, b, offset, length, srclength, pages);
+		put_stream(streams, stream);
+		return res;
+	}
+
+	if (msblk->decomp_mode == SQUASHFS_DECOMP_PERCPU)
+		stream = &streams->stream[raw_smp_processor_id()];
+	else
+		stream = &streams->stream[0];
+
+	mutex_lock(&stream->mutex);
+	res = msblk->decompressor->decompress(msblk, stream->strm, buffer, bh,
+		b, offset, length, srclength, pages);
+	mutex_unlock(&stream->mutex);
+
+	return res;
+}
@@ -26,7 +26,7 @@
 struct squashfs_decompressor {
 	void	*(*init)(struct squashfs_sb_info *);
 	void	(*free)(void *);
-	int	(*decompress)(struct squashfs_sb_info *, void **,
+	int	(*decompress)(struct squashfs_sb_info *, void *, void **,
 		struct buffer_head **, int, int, int, int, int);
 	int	id;
 	char	*name;
@@ -45,13 +45,22 @@ static inline void squashfs_decompressor_free(struct squashfs_sb_info *msblk,
 		msblk->decompressor->free(s);
 }
 
-static inline int squashfs_decompress(struct squashfs_sb_info *msblk,
-	void **buffer, struct buffer_head **bh, int b, int offset, int length,
-	int srclength, int pages)
-{
-	return msblk->decompressor->decompress(msblk, buffer, bh, b, offset,
-		length, srclength, pages);
-}
+/*
+ * How decompressor streams are shared by concurrent readers: a single
+ * stream, a pool grown on demand up to two streams per online cpu, or one
+ * stream per cpu.  Selected with the decompressors= mount option.
+ */
+#define SQUASHFS_DECOMP_SINGLE	0
+#define SQUASHFS_DECOMP_MULTI	1
+#define SQUASHFS_DECOMP_PERCPU	2
+
+#if defined(CONFIG_SQUASHFS_DECOMP_MULTI)
+#define SQUASHFS_DECOMP_DEFAULT	SQUASHFS_DECOMP_MULTI
+#elif defined(CONFIG_SQUASHFS_DECOMP_MULTI_PERCPU)
+#define SQUASHFS_DECOMP_DEFAULT	SQUASHFS_DECOMP_PERCPU
+#else
+#define SQUASHFS_DECOMP_DEFAULT	SQUASHFS_DECOMP_SINGLE
+#endif
 
 #ifdef CONFIG_SQUASHFS_XZ
 extern const struct squashfs_decompressor squashfs_xz_comp_ops;
@@ -1394,19 +1394,59 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache 
  *   provides write buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   The cache can be sized to hundreds of chunks per device, so chunks in use
+ *   are hashed by object and chunk id, and kept on a least recently used list.
+ *   Unused chunks sit on a free list. Flushes write the dirty chunks out
+ *   sorted by object and chunk id, so that each file is written sequentially.
  */
 
+static int yaffs_cache_hash(struct yaffs_dev *dev, const struct yaffs_obj *obj,
+			    int chunk_id)
+{
+	return (obj->obj_id * 31 + (u32) chunk_id) % dev->n_cache_buckets;
+}
+
+/* Take a free cache chunk into use for a chunk of a file */
+static void yaffs_cache_attach(struct yaffs_dev *dev, struct yaffs_cache *cache,
+			       struct yaffs_obj *obj, int chunk_id)
+{
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	cache->dirty = 0;
+	cache->locked = 0;
+	cache->n_bytes = 0;
+	list_add(&cache->hash_link,
+		 &dev->cache_hash[yaffs_cache_hash(dev, obj, chunk_id)]);
+	list_move_tail(&cache->lru_link, &dev->cache_lru);
+}
+
+static void yaffs_cache_clean(struct yaffs_dev *dev, struct yaffs_cache *cache)
+{
+	if (cache->dirty) {
+		cache->dirty = 0;
+		dev->n_dirty_caches--;
+	}
+}
+
+/* Drop a cache chunk, without writing it out, and put it on the free list */
+static void yaffs_cache_release(struct yaffs_dev *dev,
+				struct yaffs_cache *cache)
+{
+	yaffs_cache_clean(dev, cache);
+	cache->object = NULL;
+	list_del_init(&cache->hash_link);
+	list_move(&cache->lru_link, &dev->cache_free);
+}
+
 static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
 	struct yaffs_cache *cache;
-	int n_caches = obj->my_dev->param.n_caches;
 
-	for (i = 0; i < n_caches; i++) {
-		cache = &dev->cache[i];
+	if (dev->n_dirty_caches < 1)
+		return 0;
+
+	list_for_each_entry(cache, &dev->cache_lru, lru_link) {
 		if (cache->object == obj && cache->dirty)
 			return 1;
 	}
@@ -1414,194 +1454,158 @@ static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 	return 0;
 }
 
-static void yaffs_flush_file_cache(struct yaffs_obj *obj)
+static int yaffs_cache_cmp(const void *a, const void *b)
 {
-	struct yaffs_dev *dev = obj->my_dev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
+	const struct yaffs_cache *ca = *(const struct yaffs_cache **)a;
+	const struct yaffs_cache *cb = *(const struct yaffs_cache **)b;
+
+	if (ca->object != cb->object)
+		return ca->object->obj_id < cb->object->obj_id ? -1 : 1;
+
+	return ca->chunk_id - cb->chunk_id;
+}
+
+/*
+ * Write out and free the dirty cache chunks of 'obj', or of all objects if
+ * 'obj' is NULL, in object and chunk order.
+ */
+static void yaffs_flush_cache(struct yaffs_dev *dev, struct yaffs_obj *obj)
+{
+	struct yaffs_cache **list = dev->cache_flush;
 	struct yaffs_cache *cache;
-	int chunk_written = 0;
-	int n_caches = obj->my_dev->param.n_caches;
-
-	if (n_caches > 0) {
-		do {
-			cache = NULL;
-
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < n_caches; i++) {
-				if (dev->cache[i].object == obj &&
-				    dev->cache[i].dirty) {
-					if (!cache
-					    || dev->cache[i].chunk_id <
-					    lowest) {
-						cache = &dev->cache[i];
-						lowest = cache->chunk_id;
-					}
-				}
-			}
+	int chunk_written;
+	int n = 0;
+	int i;
 
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+	if (dev->param.n_caches < 1 || dev->n_dirty_caches < 1)
+		return;
 
-				chunk_written =
-				    yaffs_wr_data_obj(cache->object,
-						      cache->chunk_id,
-						      cache->data,
-						      cache->n_bytes, 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
+	list_for_each_entry(cache, &dev->cache_lru, lru_link) {
+		if (cache->dirty && !cache->locked &&
+		    (!obj || cache->object == obj))
+			list[n++] = cache;
+	}
+
+	if (n < 1)
+		return;
 
-		} while (cache && chunk_written > 0);
+	if (n > 1)
+		sort(list, n, sizeof(struct yaffs_cache *), yaffs_cache_cmp,
+		     NULL);
 
-		if (cache)
+	dev->cache_flushes++;
+
+	for (i = 0; i < n; i++) {
+		cache = list[i];
+
+		/* Writing may have garbage collected and invalidated it */
+		if (!cache->dirty)
+			continue;
+
+		chunk_written = yaffs_wr_data_obj(cache->object,
+						  cache->chunk_id,
+						  cache->data,
+						  cache->n_bytes, 1);
+		if (chunk_written <= 0) {
 			/* Hoosterman, disk full while writing cache out. */
 			yaffs_trace(YAFFS_TRACE_ERROR,
 				"yaffs tragedy: no space during cache write");
+			break;
+		}
 
+		dev->cache_flushed_chunks++;
+		yaffs_cache_release(dev, cache);
 	}
+}
 
+static void yaffs_flush_file_cache(struct yaffs_obj *obj)
+{
+	yaffs_flush_cache(obj->my_dev, obj);
 }
 
 /*yaffs_flush_whole_cache(dev)
  *
- *
+ * Flushes the dirty chunks of all objects in one sorted batch.
  */
 
 void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 {
-	struct yaffs_obj *obj;
-	int n_caches = dev->param.n_caches;
-	int i;
-
-	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
-	 */
-	do {
-		obj = NULL;
-		for (i = 0; i < n_caches && !obj; i++) {
-			if (dev->cache[i].object && dev->cache[i].dirty)
-				obj = dev->cache[i].object;
-
-		}
-		if (obj)
-			yaffs_flush_file_cache(obj);
-
-	} while (obj);
-
+	yaffs_flush_cache(dev, NULL);
 }
 
 /* Grab us a cache chunk for use.
  * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+ * Then take the least recently used non-dirty one.
+ * Then flush the object owning the least recently used dirty one and look again.
+ * The chunk returned is on the free list; yaffs_cache_attach() it.
  */
-static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
-{
-	int i;
-
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
-		}
-	}
-
-	return NULL;
-}
-
 static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
 {
 	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
-
-	if (dev->param.n_caches > 0) {
-		/* Try find a non-dirty one... */
 
-		cache = yaffs_grab_chunk_worker(dev);
-
-		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
-			 */
+	if (dev->param.n_caches < 1)
+		return NULL;
 
-			/* With locking we can't assume we can use entry zero */
+	if (list_empty(&dev->cache_free)) {
+		/* With locking we can't assume we can use the first one */
+		list_for_each_entry(cache, &dev->cache_lru, lru_link) {
+			if (!cache->locked)
+				break;
+		}
 
-			the_obj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
+		if (&cache->lru_link == &dev->cache_lru)
+			return NULL;
 
-			for (i = 0; i < dev->param.n_caches; i++) {
-				if (dev->cache[i].object &&
-				    !dev->cache[i].locked &&
-				    (dev->cache[i].last_use < usage
-				     || !cache)) {
-					usage = dev->cache[i].last_use;
-					the_obj = dev->cache[i].object;
-					cache = &dev->cache[i];
-					pushout = i;
-				}
-			}
+		if (cache->dirty)
+			yaffs_flush_file_cache(cache->object);
+		else
+			yaffs_cache_release(dev, cache);
 
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_flush_file_cache(the_obj);
-				cache = yaffs_grab_chunk_worker(dev);
-			}
+		if (list_empty(&dev->cache_free))
+			return NULL;
+	}
 
-		}
-		return cache;
-	} else {
-		return NULL;
-        }
+	return list_first_entry(&dev->cache_free, struct yaffs_cache,
+				lru_link);
 }
 
-/* Find a cached chunk */
+/* Find a cached chunk. Only reads and writes count as hits and misses. */
 static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
-						  int chunk_id)
+						  int chunk_id, int is_access)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].chunk_id == chunk_id) {
-				dev->cache_hits++;
+	struct yaffs_cache *cache;
+	struct list_head *bucket;
 
-				return &dev->cache[i];
-			}
+	if (dev->param.n_caches < 1)
+		return NULL;
+
+	bucket = &dev->cache_hash[yaffs_cache_hash(dev, obj, chunk_id)];
+	list_for_each_entry(cache, bucket, hash_link) {
+		if (cache->object == obj && cache->chunk_id == chunk_id) {
+			if (is_access)
+				dev->cache_hits++;
+			return cache;
 		}
 	}
+
+	if (is_access)
+		dev->cache_misses++;
 	return NULL;
 }
 
-/* Mark the chunk for the least recently used algorithym */
+/* Mark the chunk as the most recently used */
 static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 			    int is_write)
 {
 
 	if (dev->param.n_caches > 0) {
-		if (dev->cache_last_use < 0 || dev->cache_last_use > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.n_caches; i++)
-				dev->cache[i].last_use = 0;
-
-			dev->cache_last_use = 0;
-		}
+		list_move_tail(&cache->lru_link, &dev->cache_lru);
 
-		dev->cache_last_use++;
-
-		cache->last_use = dev->cache_last_use;
-
-		if (is_write)
+		if (is_write && !cache->dirty) {
 			cache->dirty = 1;
+			dev->n_dirty_caches++;
+		}
 	}
 }
 
@@ -1613,10 +1617,10 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 {
 	if (object->my_dev->param.n_caches > 0) {
 		struct yaffs_cache *cache =
-		    yaffs_find_chunk_cache(object, chunk_id);
+		    yaffs_find_chunk_cache(object, chunk_id, 0);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_cache_release(object->my_dev, cache);
 	}
 }
 
@@ -1625,14 +1629,16 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
  */
 static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 {
-	int i;
 	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_cache *cache;
+	struct yaffs_cache *next;
 
 	if (dev->param.n_caches > 0) {
 		/* Invalidate it. */
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
+		list_for_each_entry_safe(cache, next, &dev->cache_lru,
+					 lru_link) {
+			if (cache->object == in)
+				yaffs_cache_release(dev, cache);
 		}
 	}
 }
@@ -2715,9 +2721,28 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 	return ret_val;
 }
 
+/*
+ * Cost-benefit score of collecting a block: the space it frees, weighted by
+ * how long its data has been left alone, over the cost of copying the chunks
+ * still in use. Age is counted in blocks allocated since, which is what the
+ * sequence numbers measure.
+ */
+static unsigned yaffs_gc_score(struct yaffs_dev *dev,
+			       struct yaffs_block_info *bi, int pages_used)
+{
+	unsigned age = dev->seq_number - bi->seq_number;
+
+	if (age > 0xffff)
+		age = 0xffff;
+
+	return (dev->param.chunks_per_block - pages_used) * (age + 1) /
+	    (2 * pages_used + 1);
+}
+
 /*
  * FindBlockForgarbageCollection is used to select the dirtiest block (or close enough)
- * for garbage collection.
+ * for garbage collection. With YAFFS_GC_POLICY_COST_BENEFIT, "dirtiest" means
+ * the best yaffs_gc_score() instead.
  */
 
 static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
@@ -2734,6 +2759,7 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 	/* First let's see if we need to grab a prioritised block */
 	if (dev->has_pending_prioritised_gc && !aggressive) {
 		dev->gc_dirtiest = 0;
+		dev->gc_score = 0;
 		bi = dev->block_info;
 		for (i = dev->internal_start_block;
 		     i <= dev->internal_end_block && !selected; i++) {
@@ -2771,6 +2797,9 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 
 	if (!selected) {
 		int pages_used;
+		unsigned score;
+		int cost_benefit =
+		    (dev->param.gc_policy == YAFFS_GC_POLICY_COST_BENEFIT);
 		int n_blocks =
 		    dev->internal_end_block - dev->internal_start_block + 1;
 		if (aggressive) {
@@ -2811,14 +2840,18 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 			bi = yaffs_get_block_info(dev, dev->gc_block_finder);
 
 			pages_used = bi->pages_in_use - bi->soft_del_pages;
+			score = cost_benefit ?
+			    yaffs_gc_score(dev, bi, pages_used) : 0;
 
 			if (bi->block_state == YAFFS_BLOCK_STATE_FULL &&
 			    pages_used < dev->param.chunks_per_block &&
-			    (dev->gc_dirtiest < 1
-			     || pages_used < dev->gc_pages_in_use)
+			    (dev->gc_dirtiest < 1 ||
+			     (cost_benefit ? score > dev->gc_score :
+			      pages_used < dev->gc_pages_in_use))
 			    && yaffs_block_ok_for_gc(dev, bi)) {
 				dev->gc_dirtiest = dev->gc_block_finder;
 				dev->gc_pages_in_use = pages_used;
+				dev->gc_score = score;
 			}
 		}
 
@@ -2859,6 +2892,7 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 
 		dev->gc_dirtiest = 0;
 		dev->gc_pages_in_use = 0;
+		dev->gc_score = 0;
 		dev->gc_not_done = 0;
 		if (dev->refresh_skip > 0)
 			dev->refresh_skip--;
@@ -2891,6 +2925,9 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 	int min_erased;
 	int erased_chunks;
 	int checkpt_block_adjust;
+	int collected = 0;
+	ktime_t start = ktime_get();
+	u32 gc_us;
 
 	if (dev->param.gc_control && (dev->param.gc_control(dev) & 1) == 0)
 		return YAFFS_OK;
@@ -2959,6 +2996,7 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 				dev->n_erased_blocks, aggressive);
 
 			gc_ok = yaffs_gc_block(dev, dev->gc_block, aggressive);
+			collected = 1;
 		}
 
 		if (dev->n_erased_blocks < (dev->param.n_reserved_blocks)
@@ -2971,6 +3009,20 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 	} while ((dev->n_erased_blocks < dev->param.n_reserved_blocks) &&
 		 (dev->gc_block > 0) && (max_tries < 2));
 
+	if (collected) {
+		gc_us = ktime_us_delta(ktime_get(), start);
+		dev->gc_us_last = gc_us;
+		if (background) {
+			if (gc_us > dev->bg_gc_us_max)
+				dev->bg_gc_us_max = gc_us;
+		} else {
+			dev->n_fg_gc_cycles++;
+			dev->fg_gc_us_total += gc_us;
+			if (gc_us > dev->fg_gc_us_max)
+				dev->fg_gc_us_max = gc_us;
+		}
+	}
+
 	return aggressive ? gc_ok : YAFFS_OK;
 }
 
@@ -3566,7 +3618,7 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 		else
 			n_copy = dev->data_bytes_per_chunk - start;
 
-		cache = yaffs_find_chunk_cache(in, chunk);
+		cache = yaffs_find_chunk_cache(in, chunk, 1);
 
 		/* If the chunk is already in the cache or it is less than a whole chunk
 		 * or we're using inband tags then use the cache (if there is caching)
@@ -3581,13 +3633,10 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 				if (!cache) {
 					cache =
 					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_cache_attach(dev, cache, in,
+							   chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
-					cache->n_bytes = 0;
 				}
 
 				yaffs_use_cache(dev, cache, 0);
@@ -3702,15 +3751,13 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 			if (dev->param.n_caches > 0) {
 				struct yaffs_cache *cache;
 				/* If we can't find the data in the cache, then load the cache */
-				cache = yaffs_find_chunk_cache(in, chunk);
+				cache = yaffs_find_chunk_cache(in, chunk, 1);
 
 				if (!cache
 				    && yaffs_check_alloc_available(dev, 1)) {
 					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_cache_attach(dev, cache, in,
+							   chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
 				} else if (cache &&
@@ -3740,7 +3787,7 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 						     cache->chunk_id,
 						     cache->data,
 						     cache->n_bytes, 1);
-						cache->dirty = 0;
+						yaffs_cache_clean(dev, cache);
 					}
 
 				} else {
@@ -4941,36 +4988,57 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->cache = NULL;
 	dev->gc_cleanup_list = NULL;
 
+	dev->cache_hash = NULL;
+	dev->cache_flush = NULL;
+	INIT_LIST_HEAD(&dev->cache_lru);
+	INIT_LIST_HEAD(&dev->cache_free);
+	dev->n_dirty_caches = 0;
+
 	if (!init_failed && dev->param.n_caches > 0) {
 		int i;
 		void *buf;
-		int cache_bytes =
-		    dev->param.n_caches * sizeof(struct yaffs_cache);
+		int cache_bytes;
 
 		if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		cache_bytes = dev->param.n_caches * sizeof(struct yaffs_cache);
+		dev->n_cache_buckets = dev->param.n_caches;
+
 		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
+		dev->cache_hash = kmalloc(dev->n_cache_buckets *
+					  sizeof(struct list_head), GFP_NOFS);
+		dev->cache_flush = kmalloc(dev->param.n_caches *
+					   sizeof(struct yaffs_cache *),
+					   GFP_NOFS);
 
 		buf = (u8 *) dev->cache;
+		if (!dev->cache_hash || !dev->cache_flush)
+			buf = NULL;
 
 		if (dev->cache)
 			memset(dev->cache, 0, cache_bytes);
 
+		for (i = 0; i < dev->n_cache_buckets && buf; i++)
+			INIT_LIST_HEAD(&dev->cache_hash[i]);
+
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
 			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
+			INIT_LIST_HEAD(&dev->cache[i].hash_link);
+			list_add_tail(&dev->cache[i].lru_link,
+				      &dev->cache_free);
 			dev->cache[i].data = buf =
 			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->cache_last_use = 0;
 	}
 
 	dev->cache_hits = 0;
+	dev->cache_misses = 0;
+	dev->cache_flushes = 0;
+	dev->cache_flushed_chunks = 0;
 
 	if (!init_failed) {
 		dev->gc_cleanup_list =
@@ -5088,6 +5156,11 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 			dev->cache = NULL;
 		}
 
+		kfree(dev->cache_hash);
+		dev->cache_hash = NULL;
+		kfree(dev->cache_flush);
+		dev->cache_flush = NULL;
+
 		kfree(dev->gc_cleanup_list);
 
 		for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++)
@@ -5132,21 +5205,13 @@ int yaffs_get_n_free_chunks(struct yaffs_dev *dev)
 	/* This is what we report to the outside world */
 
 	int n_free;
-	int n_dirty_caches;
 	int blocks_for_checkpt;
-	int i;
 
 	n_free = dev->n_free_chunks;
 	n_free += dev->n_deleted_files;
 
-	/* Now count the number of dirty chunks in the cache and subtract those */
-
-	for (n_dirty_caches = 0, i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].dirty)
-			n_dirty_caches++;
-	}
-
-	n_free -= n_dirty_caches;
+	/* Subtract the dirty chunks in the cache */
+	n_free -= dev->n_dirty_caches;
 
 	n_free -=
 	    ((dev->param.n_reserved_blocks + 1) * dev->param.chunks_per_block);
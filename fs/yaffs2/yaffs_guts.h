@@ -83,10 +83,14 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	1024
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
+/* Garbage collection policies (param.gc_policy) */
+#define YAFFS_GC_POLICY_GREEDY		0	/* dirtiest block first */
+#define YAFFS_GC_POLICY_COST_BENEFIT	1	/* weigh free space by age */
+
 /* We limit the number attempts at sucessfully saving a chunk of data.
  * Small-page devices have 32 pages per block; large-page devices have 64.
  * Default to something in the order of 5 to 10 blocks worth of chunks.
@@ -108,9 +112,10 @@
 
 /* ChunkCache is used for short read/write operations.*/
 struct yaffs_cache {
+	struct list_head hash_link;	/* in its bucket of dev->cache_hash */
+	struct list_head lru_link;	/* in dev->cache_lru or cache_free */
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -506,8 +511,9 @@ struct yaffs_param {
 	/* reserved blocks on NOR and RAM. */
 
 	int n_caches;		/* If <= 0, then short op caching is disabled, else
-				 * the number of short op caches (don't use too many).
-				 * 10 to 20 is a good bet.
+				 * the number of short op caches, at most
+				 * YAFFS_MAX_SHORT_OP_CACHES. 10 to 20 is a good bet,
+				 * hundreds for many files written at once.
 				 */
 	int use_nand_ecc;	/* Flag to decide whether or not to use NANDECC on data (yaffs1) */
 	int no_tags_ecc;	/* Flag to decide whether or not to do ECC on packed tags (yaffs2) */
@@ -518,6 +524,11 @@ struct yaffs_param {
 
 	int refresh_period;	/* How often we should check to do a block refresh */
 
+	int scan_ahead;		/* yaffs2: blocks of tags to read ahead of a
+				 * full scan in a helper thread, 0 for none */
+
+	int gc_policy;		/* YAFFS_GC_POLICY_xxx */
+
 	/* Checkpoint control. Can be set before or after initialisation */
 	u8 skip_checkpt_rd;
 	u8 skip_checkpt_wr;
@@ -667,6 +678,7 @@ struct yaffs_dev {
 	unsigned gc_block_finder;
 	unsigned gc_dirtiest;
 	unsigned gc_pages_in_use;
+	unsigned gc_score;	/* cost-benefit score of gc_dirtiest */
 	unsigned gc_not_done;
 	unsigned gc_block;
 	unsigned gc_chunk;
@@ -685,7 +697,12 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	struct list_head *cache_hash;	/* cache chunks in use, hashed */
+	int n_cache_buckets;
+	struct list_head cache_lru;	/* in use, least recently used first */
+	struct list_head cache_free;	/* not in use */
+	struct yaffs_cache **cache_flush;	/* scratch list for flushes */
+	int n_dirty_caches;
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted files live. */
@@ -734,6 +751,15 @@ struct yaffs_dev {
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
 	u32 cache_hits;
+	u32 cache_misses;
+	u32 cache_flushes;	/* Batches of dirty chunks written out */
+	u32 cache_flushed_chunks;
+	u32 scan_time_ms;	/* Duration of the last full scan */
+	u32 gc_us_last;		/* Duration of the last gc cycle */
+	u32 fg_gc_us_max;	/* Longest foreground gc cycle */
+	u32 bg_gc_us_max;	/* Longest background gc cycle */
+	u32 n_fg_gc_cycles;
+	u64 fg_gc_us_total;
 
 };
 
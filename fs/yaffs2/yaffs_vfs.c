@@ -1758,12 +1758,15 @@ struct yaffs_options {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int cache_size;
 	int tags_ecc_on;
 	int tags_ecc_overridden;
 	int lazy_loading_enabled;
 	int lazy_loading_overridden;
 	int empty_lost_and_found;
 	int empty_lost_and_found_overridden;
+	int no_scan_ahead;
+	int gc_policy;
 };
 
 #define MAX_OPT_LEN 30
@@ -1813,6 +1816,22 @@ static int yaffs_parse_options(struct yaffs_options *options,
 			options->empty_lost_and_found_overridden = 1;
 		} else if (!strcmp(cur_opt, "no-cache")) {
 			options->no_cache = 1;
+		} else if (!strncmp(cur_opt, "cache-size=", 11)) {
+			options->cache_size =
+			    simple_strtoul(cur_opt + 11, NULL, 0);
+			if (options->cache_size < 1 ||
+			    options->cache_size > YAFFS_MAX_SHORT_OP_CACHES) {
+				printk(KERN_INFO
+				       "yaffs: cache-size must be 1..%d\n",
+				       YAFFS_MAX_SHORT_OP_CACHES);
+				error = 1;
+			}
+		} else if (!strcmp(cur_opt, "no-scan-ahead")) {
+			options->no_scan_ahead = 1;
+		} else if (!strcmp(cur_opt, "gc-greedy")) {
+			options->gc_policy = YAFFS_GC_POLICY_GREEDY;
+		} else if (!strcmp(cur_opt, "gc-cost-benefit")) {
+			options->gc_policy = YAFFS_GC_POLICY_COST_BENEFIT;
 		} else if (!strcmp(cur_opt, "no-checkpoint-read")) {
 			options->skip_checkpoint_read = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-write")) {
@@ -2215,8 +2234,15 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->chunks_per_block = YAFFS_CHUNKS_PER_BLOCK;
 	param->total_bytes_per_chunk = YAFFS_BYTES_PER_CHUNK;
 	param->n_reserved_blocks = 5;
-	param->n_caches = (options.no_cache) ? 0 : 10;
+	if (options.no_cache)
+		param->n_caches = 0;
+	else if (options.cache_size)
+		param->n_caches = options.cache_size;
+	else
+		param->n_caches = 10;
 	param->inband_tags = options.inband_tags;
+	param->scan_ahead = (options.no_scan_ahead) ? 0 : 16;
+	param->gc_policy = options.gc_policy;
 
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
 	param->disable_lazy_load = 1;
@@ -2438,6 +2464,10 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "refresh_period........ %d\n",
 			param->refresh_period);
 	buf += sprintf(buf, "n_caches.............. %d\n", param->n_caches);
+	buf += sprintf(buf, "scan_ahead............ %d\n", param->scan_ahead);
+	buf += sprintf(buf, "gc_policy............. %s\n",
+			param->gc_policy == YAFFS_GC_POLICY_COST_BENEFIT ?
+			"cost-benefit" : "greedy");
 	buf += sprintf(buf, "n_reserved_blocks..... %d\n",
 			param->n_reserved_blocks);
 	buf += sprintf(buf, "always_check_erased... %d\n",
@@ -2486,12 +2516,39 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	    sprintf(buf, "n_tags_ecc_unfixed.... %u\n",
 		    dev->n_tags_ecc_unfixed);
 	buf += sprintf(buf, "cache_hits............ %u\n", dev->cache_hits);
+	buf += sprintf(buf, "cache_misses.......... %u\n", dev->cache_misses);
+	buf += sprintf(buf, "cache_flushes......... %u\n", dev->cache_flushes);
+	buf += sprintf(buf, "cache_flushed_chunks.. %u\n",
+		       dev->cache_flushed_chunks);
 	buf +=
 	    sprintf(buf, "n_deleted_files....... %u\n", dev->n_deleted_files);
 	buf +=
 	    sprintf(buf, "n_unlinked_files...... %u\n", dev->n_unlinked_files);
 	buf += sprintf(buf, "refresh_count......... %u\n", dev->refresh_count);
 	buf += sprintf(buf, "n_bg_deletions........ %u\n", dev->n_bg_deletions);
+	buf += sprintf(buf, "scan_time_ms.......... %u\n", dev->scan_time_ms);
+
+	return buf;
+}
+
+static char *yaffs_dump_dev_part2(char *buf, struct yaffs_dev *dev)
+{
+	u32 host_writes = dev->n_page_writes - dev->n_gc_copies;
+	u32 wa = 100;
+
+	/* Write amplification: pages written per page the user wrote */
+	if (host_writes)
+		wa = div_u64((u64)dev->n_page_writes * 100, host_writes);
+
+	buf += sprintf(buf, "write_amplification... %u.%02u\n",
+			wa / 100, wa % 100);
+	buf += sprintf(buf, "gc_us_last............ %u\n", dev->gc_us_last);
+	buf += sprintf(buf, "n_fg_gc_cycles........ %u\n",
+			dev->n_fg_gc_cycles);
+	buf += sprintf(buf, "fg_gc_us_total........ %llu\n",
+			(unsigned long long)dev->fg_gc_us_total);
+	buf += sprintf(buf, "fg_gc_us_max.......... %u\n", dev->fg_gc_us_max);
+	buf += sprintf(buf, "bg_gc_us_max.......... %u\n", dev->bg_gc_us_max);
 
 	return buf;
 }
@@ -2541,6 +2598,7 @@ static int yaffs_proc_read(char *page,
 				buf = yaffs_dump_dev_part0(buf, dev);
 			} else {
 				buf = yaffs_dump_dev_part1(buf, dev);
+				buf = yaffs_dump_dev_part2(buf, dev);
                         }
 
 			break;
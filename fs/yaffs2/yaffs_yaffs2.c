@@ -21,6 +21,9 @@
 #include "yaffs_verify.h"
 #include "yaffs_attribs.h"
 
+#include <linux/kthread.h>
+#include <linux/wait.h>
+
 /*
  * Checkpoints are really no benefit on very small partitions.
  *
@@ -954,6 +957,153 @@ static int yaffs2_ybicmp(const void *a, const void *b)
 		return aseq - bseq;
 }
 
+/*
+ * Scan read-ahead.
+ *
+ * A full scan spends most of its time waiting for tags to come off the flash.
+ * With param.scan_ahead set, a helper thread reads the tags of whole blocks,
+ * in the order the scan processes them, into a window of scan_ahead blocks,
+ * while the scan builds the object tree from the blocks before them.
+ *
+ * The tag read path shares buffers with the rest of yaffs, and MTD serialises
+ * access to the chip anyway, so every flash access made during the scan goes
+ * through nand_lock; only the scan's own processing runs in parallel.
+ */
+struct yaffs_scan_ahead {
+	struct yaffs_dev *dev;
+	struct yaffs_block_index *block_index;
+	int n_to_scan;
+	int depth;		/* blocks in the window */
+	struct yaffs_ext_tags *tags;	/* depth * chunks_per_block */
+	int n_read;		/* blocks whose tags have been read */
+	int n_done;		/* blocks the scan is done with */
+	int stop;
+	struct mutex nand_lock;
+	wait_queue_head_t wq;
+	struct task_struct *thread;
+};
+
+static int yaffs2_scan_ahead_fn(void *data)
+{
+	struct yaffs_scan_ahead *sa = data;
+	struct yaffs_dev *dev = sa->dev;
+	int chunks_per_block = dev->param.chunks_per_block;
+	struct yaffs_ext_tags *tags;
+	int i;
+	int c;
+	int blk;
+
+	/* Blocks are processed from the highest sequence number down */
+	for (i = 0; i < sa->n_to_scan; i++) {
+		wait_event(sa->wq, ACCESS_ONCE(sa->stop) ||
+			   i - ACCESS_ONCE(sa->n_done) < sa->depth);
+		if (sa->stop)
+			break;
+
+		blk = sa->block_index[sa->n_to_scan - 1 - i].block;
+		tags = sa->tags + (i % sa->depth) * chunks_per_block;
+
+		for (c = chunks_per_block - 1; c >= 0; c--) {
+			mutex_lock(&sa->nand_lock);
+			yaffs_rd_chunk_tags_nand(dev,
+						 blk * chunks_per_block + c,
+						 NULL, &tags[c]);
+			mutex_unlock(&sa->nand_lock);
+		}
+
+		smp_wmb();
+		sa->n_read = i + 1;
+		wake_up(&sa->wq);
+	}
+
+	wait_event(sa->wq, kthread_should_stop());
+
+	return 0;
+}
+
+static struct yaffs_scan_ahead *yaffs2_scan_ahead_start(struct yaffs_dev *dev,
+				struct yaffs_block_index *block_index,
+				int n_to_scan)
+{
+	struct yaffs_scan_ahead *sa;
+
+	if (dev->param.scan_ahead < 1 || n_to_scan < 2)
+		return NULL;
+
+	sa = kmalloc(sizeof(struct yaffs_scan_ahead), GFP_NOFS);
+	if (!sa)
+		return NULL;
+
+	memset(sa, 0, sizeof(struct yaffs_scan_ahead));
+	sa->dev = dev;
+	sa->block_index = block_index;
+	sa->n_to_scan = n_to_scan;
+	sa->depth = min(dev->param.scan_ahead, n_to_scan);
+	mutex_init(&sa->nand_lock);
+	init_waitqueue_head(&sa->wq);
+
+	sa->tags = vmalloc(sa->depth * dev->param.chunks_per_block *
+			   sizeof(struct yaffs_ext_tags));
+	if (!sa->tags) {
+		kfree(sa);
+		return NULL;
+	}
+
+	sa->thread = kthread_run(yaffs2_scan_ahead_fn, sa, "yaffs-scan");
+	if (IS_ERR(sa->thread)) {
+		vfree(sa->tags);
+		kfree(sa);
+		return NULL;
+	}
+
+	yaffs_trace(YAFFS_TRACE_SCAN, "scanning with %d blocks read-ahead",
+		sa->depth);
+
+	return sa;
+}
+
+static void yaffs2_scan_ahead_stop(struct yaffs_scan_ahead *sa)
+{
+	if (!sa)
+		return;
+
+	sa->stop = 1;
+	wake_up(&sa->wq);
+	kthread_stop(sa->thread);
+
+	vfree(sa->tags);
+	kfree(sa);
+}
+
+/* Wait for the tags of the i-th block to scan, indexed by chunk in block */
+static struct yaffs_ext_tags *yaffs2_scan_ahead_get(struct yaffs_scan_ahead *sa,
+						    int i)
+{
+	wait_event(sa->wq, ACCESS_ONCE(sa->n_read) > i);
+	smp_rmb();
+
+	return sa->tags + (i % sa->depth) * sa->dev->param.chunks_per_block;
+}
+
+/* Hand the i-th block's slot in the window back to the reader */
+static void yaffs2_scan_ahead_put(struct yaffs_scan_ahead *sa, int i)
+{
+	sa->n_done = i + 1;
+	wake_up(&sa->wq);
+}
+
+static void yaffs2_scan_lock(struct yaffs_scan_ahead *sa)
+{
+	if (sa)
+		mutex_lock(&sa->nand_lock);
+}
+
+static void yaffs2_scan_unlock(struct yaffs_scan_ahead *sa)
+{
+	if (sa)
+		mutex_unlock(&sa->nand_lock);
+}
+
 int yaffs2_scan_backwards(struct yaffs_dev *dev)
 {
 	struct yaffs_ext_tags tags;
@@ -987,6 +1137,10 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	struct yaffs_block_index *block_index = NULL;
 	int alt_block_index = 0;
 
+	struct yaffs_scan_ahead *sa;
+	struct yaffs_ext_tags *block_tags = NULL;
+	unsigned long scan_start = jiffies;
+
 	yaffs_trace(YAFFS_TRACE_SCAN,
 		"yaffs2_scan_backwards starts  intstartblk %d intendblk %d...",
 		dev->internal_start_block, dev->internal_end_block);
@@ -1086,6 +1240,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	end_iter = n_to_scan - 1;
 	yaffs_trace(YAFFS_TRACE_SCAN_DEBUG, "%d blocks to scan", n_to_scan);
 
+	sa = yaffs2_scan_ahead_start(dev, block_index, n_to_scan);
+
 	/* For each block.... backwards */
 	for (block_iter = end_iter; !alloc_failed && block_iter >= start_iter;
 	     block_iter--) {
@@ -1102,6 +1258,10 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 		deleted = 0;
 
+		if (sa)
+			block_tags = yaffs2_scan_ahead_get(sa,
+						end_iter - block_iter);
+
 		/* For each chunk in each block that needs scanning.... */
 		found_chunks = 0;
 		for (c = dev->param.chunks_per_block - 1;
@@ -1114,8 +1274,11 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 			chunk = blk * dev->param.chunks_per_block + c;
 
-			result = yaffs_rd_chunk_tags_nand(dev, chunk, NULL,
-							  &tags);
+			if (block_tags)
+				tags = block_tags[c];
+			else
+				result = yaffs_rd_chunk_tags_nand(dev, chunk,
+								  NULL, &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -1213,10 +1376,12 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 				    && chunk_base <
 				    in->variant.file_variant.shrink_size) {
 					/* This has not been invalidated by a resize */
+					yaffs2_scan_lock(sa);
 					if (!yaffs_put_chunk_in_file
 					    (in, tags.chunk_id, chunk, -1)) {
 						alloc_failed = 1;
 					}
+					yaffs2_scan_unlock(sa);
 
 					/* File size is calculated by looking at the data chunks if we have not
 					 * seen an object header yet. Stop this practice once we find an object header.
@@ -1235,8 +1400,10 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 				} else if (in) {
 					/* This chunk has been invalidated by a resize, or a past file deletion
 					 * so delete the chunk*/
+					yaffs2_scan_lock(sa);
 					yaffs_chunk_del(dev, chunk, 1,
 							__LINE__);
+					yaffs2_scan_unlock(sa);
 
 				}
 			} else {
@@ -1276,10 +1443,12 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 					 * living with invalid data until needed.
 					 */
 
+					yaffs2_scan_lock(sa);
 					result = yaffs_rd_chunk_tags_nand(dev,
 									  chunk,
 									  chunk_data,
 									  NULL);
+					yaffs2_scan_unlock(sa);
 
 					oh = (struct yaffs_obj_hdr *)chunk_data;
 
@@ -1366,8 +1535,10 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 					}
 					/* Use existing - destroy this one. */
+					yaffs2_scan_lock(sa);
 					yaffs_chunk_del(dev, chunk, 1,
 							__LINE__);
+					yaffs2_scan_unlock(sa);
 
 				}
 
@@ -1409,11 +1580,14 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 						in->yst_mode = oh->yst_mode;
 						yaffs_load_attribs(in, oh);
 
-						if (oh->shadows_obj > 0)
+						if (oh->shadows_obj > 0) {
+							yaffs2_scan_lock(sa);
 							yaffs_handle_shadowed_obj
 							    (dev,
 							     oh->shadows_obj,
 							     1);
+							yaffs2_scan_unlock(sa);
+						}
 
 						yaffs_set_obj_name_from_oh(in,
 									   oh);
@@ -1568,11 +1742,17 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 		if (bi->pages_in_use == 0 &&
 		    !bi->has_shrink_hdr &&
 		    bi->block_state == YAFFS_BLOCK_STATE_FULL) {
+			yaffs2_scan_lock(sa);
 			yaffs_block_became_dirty(dev, blk);
+			yaffs2_scan_unlock(sa);
 		}
 
+		if (sa)
+			yaffs2_scan_ahead_put(sa, end_iter - block_iter);
 	}
 
+	yaffs2_scan_ahead_stop(sa);
+
 	yaffs_skip_rest_of_block(dev);
 
 	if (alt_block_index)
@@ -1589,10 +1769,13 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	yaffs_release_temp_buffer(dev, chunk_data, __LINE__);
 
+	dev->scan_time_ms = jiffies_to_msecs(jiffies - scan_start);
+
 	if (alloc_failed)
 		return YAFFS_FAIL;
 
-	yaffs_trace(YAFFS_TRACE_SCAN, "yaffs2_scan_backwards ends");
+	yaffs_trace(YAFFS_TRACE_SCAN, "yaffs2_scan_backwards ends after %u ms",
+		dev->scan_time_ms);
 
 	return YAFFS_OK;
 }
@@ -50,6 +50,10 @@ struct android_pmem_platform_data
 	unsigned cached;
 	/* The MSM7k has bits to enable a write buffer in the bus controller*/
 	unsigned buffered;
+	/* set to lend the region to the page allocator while it is unused,
+	 * it must then be pageblock aligned memory reserved with memblock,
+	 * see CONFIG_ANDROID_PMEM_LEND */
+	unsigned lend;
 };
 
 struct pmem_region {
@@ -41,7 +41,18 @@
 #define MIGRATE_PCPTYPES      3 /* the number of types on the pcp lists */
 #define MIGRATE_RESERVE       3
 #define MIGRATE_ISOLATE       4 /* can't allocate from here */
+#ifdef CONFIG_CONTIG_LEND
+#define MIGRATE_LENT          5 /* lent by a driver, movable allocations only */
+#define MIGRATE_TYPES         6
+#else
 #define MIGRATE_TYPES         5
+#endif
+
+#ifdef CONFIG_CONTIG_LEND
+#  define is_migrate_lent(migratetype) unlikely((migratetype) == MIGRATE_LENT)
+#else
+#  define is_migrate_lent(migratetype) false
+#endif
 
 #define for_each_migratetype_order(order, type) \
 	for (order = 0; order < MAX_ORDER; order++) \
@@ -33,5 +33,21 @@ test_pages_isolated(unsigned long start_pfn, unsigned long end_pfn);
 extern int set_migratetype_isolate(struct page *page);
 extern void unset_migratetype_isolate(struct page *page);
 
+#ifdef CONFIG_CONTIG_LEND
+/*
+ * Gives reserved memory in [start_pfn, end_pfn) to the page allocator as
+ * MIGRATE_LENT pageblocks, which only movable allocations may use.
+ * The range must be pageblock aligned.
+ */
+extern void lend_contig_range(unsigned long start_pfn, unsigned long end_pfn);
+
+/*
+ * Takes back a range given away with lend_contig_range(), migrating the
+ * pages in use elsewhere. Returns -EBUSY, leaving the range lent, if some
+ * could not be moved. On success the range is reserved memory again.
+ */
+extern int reclaim_contig_range(unsigned long start_pfn, unsigned long end_pfn);
+#endif
+
 
 #endif
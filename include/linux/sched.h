@@ -1249,6 +1249,9 @@ struct task_struct {
 #endif
 
 	struct list_head tasks;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct hlist_node oom_adj_node;	/* in oom_adj_index, if leader */
+#endif
 #ifdef CONFIG_SMP
 	struct plist_node pushable_tasks;
 #endif
@@ -18,6 +18,7 @@
 
 #include <linux/list.h>
 #include <linux/ktime.h>
+#include <linux/timerqueue.h>
 
 /* A wake_lock prevents the system from entering suspend or other low power
  * states when active. If the type is set to WAKE_LOCK_SUSPEND, the wake_lock
@@ -38,6 +39,8 @@ struct wake_lock {
 	int                 flags;
 	const char         *name;
 	unsigned long       expires;
+	/* in the timeout queue of its type while active with a timeout */
+	struct timerqueue_node timeout_node;
 #ifdef CONFIG_WAKELOCK_STAT
 	struct {
 		int             count;
@@ -52,6 +55,28 @@ struct wake_lock {
 #endif
 };
 
+/* /proc/wakelocks_bin holds one of these for each wake lock, in native byte
+ * order. Each record is followed by the NUL terminated lock name, padded so
+ * the next record is 8 byte aligned; size covers record, name and padding.
+ * Times are in nanoseconds.
+ */
+struct wake_lock_stat_record {
+	__u32 size;
+	__u32 flags;		/* type, WAKE_LOCK_STAT_ACTIVE */
+	__s32 count;
+	__s32 expire_count;
+	__s32 wakeup_count;
+	__u32 reserved;
+	__s64 active_since;	/* held for this long, if active */
+	__s64 total_time;
+	__s64 prevent_suspend_time;
+	__s64 max_time;
+	__s64 last_time;	/* last lock or unlock, monotonic clock */
+};
+
+#define WAKE_LOCK_STAT_TYPE_MASK	(0x0f)
+#define WAKE_LOCK_STAT_ACTIVE		(1U << 8)
+
 #ifdef CONFIG_HAS_WAKELOCK
 
 void wake_lock_init(struct wake_lock *lock, int type, const char *name);
@@ -0,0 +1,91 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_TRACE_LOWMEMORYKILLER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/sched.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmem_kill,
+
+	TP_PROTO(struct task_struct *p, int oom_adj, int tasksize, int level,
+		 int other_free, int other_file, s64 select_ns),
+
+	TP_ARGS(p, oom_adj, tasksize, level, other_free, other_file,
+		select_ns),
+
+	TP_STRUCT__entry(
+		__array(	char,	comm,	TASK_COMM_LEN	)
+		__field(	pid_t,	pid			)
+		__field(	int,	oom_adj			)
+		__field(	int,	tasksize		)
+		__field(	int,	level			)
+		__field(	int,	other_free		)
+		__field(	int,	other_file		)
+		__field(	s64,	select_ns		)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->comm, p->comm, TASK_COMM_LEN);
+		__entry->pid		= p->pid;
+		__entry->oom_adj	= oom_adj;
+		__entry->tasksize	= tasksize;
+		__entry->level		= level;
+		__entry->other_free	= other_free;
+		__entry->other_file	= other_file;
+		__entry->select_ns	= select_ns;
+	),
+
+	TP_printk("comm=%s pid=%d oom_adj=%d tasksize=%d level=%d "
+		  "other_free=%d other_file=%d select_ns=%lld",
+		__entry->comm, __entry->pid, __entry->oom_adj,
+		__entry->tasksize, __entry->level, __entry->other_free,
+		__entry->other_file, __entry->select_ns)
+);
+
+TRACE_EVENT(lowmem_kill_done,
+
+	TP_PROTO(struct task_struct *p, s64 latency_ns),
+
+	TP_ARGS(p, latency_ns),
+
+	TP_STRUCT__entry(
+		__array(	char,	comm,	TASK_COMM_LEN	)
+		__field(	pid_t,	pid			)
+		__field(	s64,	latency_ns		)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->comm, p->comm, TASK_COMM_LEN);
+		__entry->pid		= p->pid;
+		__entry->latency_ns	= latency_ns;
+	),
+
+	TP_printk("comm=%s pid=%d latency_ns=%lld",
+		__entry->comm, __entry->pid, __entry->latency_ns)
+);
+
+TRACE_EVENT(lowmem_deathpending,
+
+	TP_PROTO(struct task_struct *p, int timed_out),
+
+	TP_ARGS(p, timed_out),
+
+	TP_STRUCT__entry(
+		__field(	pid_t,	pid			)
+		__field(	int,	timed_out		)
+	),
+
+	TP_fast_assign(
+		__entry->pid		= p->pid;
+		__entry->timed_out	= timed_out;
+	),
+
+	TP_printk("pid=%d timed_out=%d", __entry->pid, __entry->timed_out)
+);
+
+#endif /* _TRACE_LOWMEMORYKILLER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
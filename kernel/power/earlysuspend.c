@@ -13,7 +13,9 @@
  *
  */
 
+#include <linux/async.h>
 #include <linux/earlysuspend.h>
+#include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/rtc.h>
@@ -26,10 +28,20 @@
 enum {
 	DEBUG_USER_STATE = 1U << 0,
 	DEBUG_SUSPEND = 1U << 2,
+	DEBUG_HANDLER_TIME = 1U << 3,
 };
 static int debug_mask = DEBUG_USER_STATE;
 module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 
+/* Handlers of the same level are independent of each other and, unless
+ * parallel is cleared, run concurrently. Levels still run in order. */
+static int parallel = 1;
+module_param(parallel, int, S_IRUGO | S_IWUSR | S_IWGRP);
+
+/* handlers slower than this are logged even without DEBUG_HANDLER_TIME */
+static int slow_handler_ms = 100;
+module_param(slow_handler_ms, int, S_IRUGO | S_IWUSR | S_IWGRP);
+
 static DEFINE_MUTEX(early_suspend_lock);
 static LIST_HEAD(early_suspend_handlers);
 static void early_suspend(struct work_struct *work);
@@ -43,6 +55,7 @@ enum {
 	SUSPEND_REQUESTED_AND_SUSPENDED = SUSPEND_REQUESTED | SUSPENDED,
 };
 static int state;
+static LIST_HEAD(early_suspend_domain);
 
 void register_early_suspend(struct early_suspend *handler)
 {
@@ -70,11 +83,59 @@ void unregister_early_suspend(struct early_suspend *handler)
 }
 EXPORT_SYMBOL(unregister_early_suspend);
 
+static void call_handler(struct early_suspend *handler, int resume)
+{
+	void (*func)(struct early_suspend *h);
+	ktime_t start;
+	s64 delta_ms;
+	s32 rem_us;
+
+	func = resume ? handler->resume : handler->suspend;
+	start = ktime_get();
+	func(handler);
+	delta_ms = div_s64_rem(ktime_to_us(ktime_sub(ktime_get(), start)),
+			       USEC_PER_MSEC, &rem_us);
+	if ((debug_mask & DEBUG_HANDLER_TIME) || delta_ms >= slow_handler_ms)
+		pr_info("%s: level %d %pf took %lld.%03d ms\n",
+			resume ? "late_resume" : "early_suspend",
+			handler->level, func, delta_ms, rem_us);
+}
+
+static void early_suspend_async(void *data, async_cookie_t cookie)
+{
+	call_handler(data, 0);
+}
+
+static void late_resume_async(void *data, async_cookie_t cookie)
+{
+	call_handler(data, 1);
+}
+
+/* Runs or queues one handler, first waiting for the handlers of the
+ * previous level to finish. Caller must hold early_suspend_lock. */
+static void queue_handler(struct early_suspend *handler, int resume,
+			  int *level)
+{
+	if (!(resume ? handler->resume : handler->suspend))
+		return;
+	if (handler->level != *level) {
+		async_synchronize_full_domain(&early_suspend_domain);
+		*level = handler->level;
+	}
+	if (parallel)
+		async_schedule_domain(resume ? late_resume_async :
+				      early_suspend_async, handler,
+				      &early_suspend_domain);
+	else
+		call_handler(handler, resume);
+}
+
 static void early_suspend(struct work_struct *work)
 {
 	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
+	int level = INT_MIN;
 
 	mutex_lock(&early_suspend_lock);
 	spin_lock_irqsave(&state_lock, irqflags);
@@ -93,10 +154,9 @@ static void early_suspend(struct work_struct *work)
 
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("early_suspend: call handlers\n");
-	list_for_each_entry(pos, &early_suspend_handlers, link) {
-		if (pos->suspend != NULL)
-			pos->suspend(pos);
-	}
+	list_for_each_entry(pos, &early_suspend_handlers, link)
+		queue_handler(pos, 0, &level);
+	async_synchronize_full_domain(&early_suspend_domain);
 	mutex_unlock(&early_suspend_lock);
 
 	if (debug_mask & DEBUG_SUSPEND)
@@ -115,6 +175,7 @@ static void late_resume(struct work_struct *work)
 	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
+	int level = INT_MIN;
 
 	mutex_lock(&early_suspend_lock);
 	spin_lock_irqsave(&state_lock, irqflags);
@@ -132,8 +193,8 @@ static void late_resume(struct work_struct *work)
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: call handlers\n");
 	list_for_each_entry_reverse(pos, &early_suspend_handlers, link)
-		if (pos->resume != NULL)
-			pos->resume(pos);
+		queue_handler(pos, 1, &level);
+	async_synchronize_full_domain(&early_suspend_domain);
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: done\n");
 abort:
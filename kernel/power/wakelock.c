@@ -43,6 +43,10 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 static DEFINE_SPINLOCK(list_lock);
 static LIST_HEAD(inactive_locks);
 static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
+/* the active locks of each type without a timeout are only counted, the
+ * ones with a timeout are queued by expiry, earliest first */
+static int active_untimed[WAKE_LOCK_TYPE_COUNT];
+static struct timerqueue_head active_timeouts[WAKE_LOCK_TYPE_COUNT];
 static int current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct wake_lock main_wake_lock;
@@ -81,7 +85,8 @@ int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 }
 
 
-static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
+static void get_lock_stat(struct wake_lock *lock,
+			  struct wake_lock_stat_record *rec)
 {
 	int lock_count = lock->stat.count;
 	int expire_count = lock->stat.expire_count;
@@ -90,6 +95,7 @@ static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 	ktime_t max_time = lock->stat.max_time;
 
 	ktime_t prevent_suspend_time = lock->stat.prevent_suspend_time;
+	rec->flags = lock->flags & WAKE_LOCK_TYPE_MASK;
 	if (lock->flags & WAKE_LOCK_ACTIVE) {
 		ktime_t now, add_time;
 		int expired = get_expired_time(lock, &now);
@@ -107,15 +113,43 @@ static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 					ktime_sub(now, last_sleep_time_update));
 		if (add_time.tv64 > max_time.tv64)
 			max_time = add_time;
+		rec->flags |= WAKE_LOCK_STAT_ACTIVE;
 	}
 
+	rec->count = lock_count;
+	rec->expire_count = expire_count;
+	rec->wakeup_count = lock->stat.wakeup_count;
+	rec->reserved = 0;
+	rec->active_since = ktime_to_ns(active_time);
+	rec->total_time = ktime_to_ns(total_time);
+	rec->prevent_suspend_time = ktime_to_ns(prevent_suspend_time);
+	rec->max_time = ktime_to_ns(max_time);
+	rec->last_time = ktime_to_ns(lock->stat.last_time);
+}
+
+static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
+{
+	struct wake_lock_stat_record rec;
+
+	get_lock_stat(lock, &rec);
 	return seq_printf(m,
 		     "\"%s\"\t%d\t%d\t%d\t%lld\t%lld\t%lld\t%lld\t%lld\n",
-		     lock->name, lock_count, expire_count,
-		     lock->stat.wakeup_count, ktime_to_ns(active_time),
-		     ktime_to_ns(total_time),
-		     ktime_to_ns(prevent_suspend_time), ktime_to_ns(max_time),
-		     ktime_to_ns(lock->stat.last_time));
+		     lock->name, rec.count, rec.expire_count,
+		     rec.wakeup_count, rec.active_since, rec.total_time,
+		     rec.prevent_suspend_time, rec.max_time, rec.last_time);
+}
+
+static int write_lock_stat(struct seq_file *m, struct wake_lock *lock)
+{
+	static const char pad[8];
+	struct wake_lock_stat_record rec;
+	size_t name_len = strlen(lock->name) + 1;
+
+	get_lock_stat(lock, &rec);
+	rec.size = ALIGN(sizeof(rec) + name_len, 8);
+	seq_write(m, &rec, sizeof(rec));
+	seq_write(m, lock->name, name_len);
+	return seq_write(m, pad, rec.size - sizeof(rec) - name_len);
 }
 
 static int wakelock_stats_show(struct seq_file *m, void *unused)
@@ -139,6 +173,23 @@ static int wakelock_stats_show(struct seq_file *m, void *unused)
 	return 0;
 }
 
+static int wakelock_stats_bin_show(struct seq_file *m, void *unused)
+{
+	unsigned long irqflags;
+	struct wake_lock *lock;
+	int type;
+
+	spin_lock_irqsave(&list_lock, irqflags);
+	list_for_each_entry(lock, &inactive_locks, link)
+		write_lock_stat(m, lock);
+	for (type = 0; type < WAKE_LOCK_TYPE_COUNT; type++) {
+		list_for_each_entry(lock, &active_wake_locks[type], link)
+			write_lock_stat(m, lock);
+	}
+	spin_unlock_irqrestore(&list_lock, irqflags);
+	return 0;
+}
+
 static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 {
 	ktime_t duration;
@@ -193,14 +244,27 @@ static void update_sleep_wait_stats_locked(int done)
 #endif
 
 
+/* Caller must acquire the list_lock spinlock */
+static void deactivate_wake_lock(struct wake_lock *lock)
+{
+	int type = lock->flags & WAKE_LOCK_TYPE_MASK;
+
+	if (!(lock->flags & WAKE_LOCK_ACTIVE))
+		return;
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		timerqueue_del(&active_timeouts[type], &lock->timeout_node);
+	else
+		active_untimed[type]--;
+	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
+	list_move(&lock->link, &inactive_locks);
+}
+
 static void expire_wake_lock(struct wake_lock *lock)
 {
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_unlock_stat_locked(lock, 1);
 #endif
-	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
-	list_add(&lock->link, &inactive_locks);
+	deactivate_wake_lock(lock);
 	if (debug_mask & (DEBUG_WAKE_LOCK | DEBUG_EXPIRE))
 		pr_info("expired wake lock %s\n", lock->name);
 }
@@ -228,23 +292,24 @@ static void print_active_locks(int type)
 	}
 }
 
+/* Expires the timed out locks of the type. Returns -1 if a lock with no
+ * timeout is active, else the number of jiffies until the next timeout or
+ * 0 if no lock is active. Caller must acquire the list_lock spinlock. */
 static long has_wake_lock_locked(int type)
 {
-	struct wake_lock *lock, *n;
-	long max_timeout = 0;
+	struct timerqueue_node *node;
+	u64 now = get_jiffies_64();
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+	while ((node = timerqueue_getnext(&active_timeouts[type]))) {
+		if (node->expires.tv64 > (s64)now)
+			break;
+		expire_wake_lock(container_of(node, struct wake_lock,
+					      timeout_node));
 	}
-	return max_timeout;
+	if (active_untimed[type])
+		return -1;
+	return node ? node->expires.tv64 - now : 0;
 }
 
 long has_wake_lock(int type)
@@ -253,6 +318,13 @@ long has_wake_lock(int type)
 	unsigned long irqflags;
 	spin_lock_irqsave(&list_lock, irqflags);
 	ret = has_wake_lock_locked(type);
+	/* callers are told when all locks time out, not the first one */
+	if (ret > 0) {
+		struct timerqueue_node *last =
+			rb_entry(rb_last(&active_timeouts[type].head),
+				 struct timerqueue_node, node);
+		ret = max_t(long, last->expires.tv64 - get_jiffies_64(), 1);
+	}
 	if (ret && (debug_mask & DEBUG_SUSPEND) && type == WAKE_LOCK_SUSPEND)
 		print_active_locks(type);
 	spin_unlock_irqrestore(&list_lock, irqflags);
@@ -293,6 +365,8 @@ static void suspend(struct work_struct *work)
 }
 static DECLARE_WORK(suspend_work, suspend);
 
+static struct timer_list expire_timer;
+
 static void expire_wake_locks(unsigned long data)
 {
 	long has_lock;
@@ -307,9 +381,12 @@ static void expire_wake_locks(unsigned long data)
 		pr_info("expire_wake_locks: done, has_lock %ld\n", has_lock);
 	if (has_lock == 0)
 		queue_work(suspend_work_queue, &suspend_work);
+	else if (has_lock > 0)
+		mod_timer(&expire_timer, jiffies + has_lock);
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
-static DEFINE_TIMER(expire_timer, expire_wake_locks, 0, 0);
+static struct timer_list expire_timer =
+		TIMER_INITIALIZER(expire_wake_locks, 0, 0);
 
 static int power_suspend_late(struct device *dev)
 {
@@ -356,6 +433,7 @@ void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 	lock->flags = (type & WAKE_LOCK_TYPE_MASK) | WAKE_LOCK_INITIALIZED;
 
 	INIT_LIST_HEAD(&lock->link);
+	timerqueue_init(&lock->timeout_node);
 	spin_lock_irqsave(&list_lock, irqflags);
 	list_add(&lock->link, &inactive_locks);
 	spin_unlock_irqrestore(&list_lock, irqflags);
@@ -384,6 +462,7 @@ void wake_lock_destroy(struct wake_lock *lock)
 				  lock->stat.max_time);
 	}
 #endif
+	deactivate_wake_lock(lock);
 	list_del(&lock->link);
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
@@ -395,6 +474,7 @@ static void wake_lock_internal(
 	int type;
 	unsigned long irqflags;
 	long expire_in;
+	u64 now;
 
 	spin_lock_irqsave(&list_lock, irqflags);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
@@ -418,21 +498,28 @@ static void wake_lock_internal(
 #ifdef CONFIG_WAKELOCK_STAT
 		lock->stat.last_time = ktime_get();
 #endif
-	}
+	} else if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		timerqueue_del(&active_timeouts[type], &lock->timeout_node);
+	else
+		active_untimed[type]--;
 	list_del(&lock->link);
 	if (has_timeout) {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d, timeout %ld.%03lu\n",
 				lock->name, type, timeout / HZ,
 				(timeout % HZ) * MSEC_PER_SEC / HZ);
-		lock->expires = jiffies + timeout;
+		now = get_jiffies_64();
+		lock->expires = (unsigned long)now + timeout;
 		lock->flags |= WAKE_LOCK_AUTO_EXPIRE;
+		lock->timeout_node.expires.tv64 = now + timeout;
+		timerqueue_add(&active_timeouts[type], &lock->timeout_node);
 		list_add_tail(&lock->link, &active_wake_locks[type]);
 	} else {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d\n", lock->name, type);
 		lock->expires = LONG_MAX;
 		lock->flags &= ~WAKE_LOCK_AUTO_EXPIRE;
+		active_untimed[type]++;
 		list_add(&lock->link, &active_wake_locks[type]);
 	}
 	if (type == WAKE_LOCK_SUSPEND) {
@@ -487,9 +574,7 @@ void wake_unlock(struct wake_lock *lock)
 #endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
-	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
-	list_add(&lock->link, &inactive_locks);
+	deactivate_wake_lock(lock);
 	if (type == WAKE_LOCK_SUSPEND) {
 		long has_lock = has_wake_lock_locked(type);
 		if (has_lock > 0) {
@@ -536,13 +621,28 @@ static const struct file_operations wakelock_stats_fops = {
 	.release = single_release,
 };
 
+static int wakelock_stats_bin_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wakelock_stats_bin_show, NULL);
+}
+
+static const struct file_operations wakelock_stats_bin_fops = {
+	.owner = THIS_MODULE,
+	.open = wakelock_stats_bin_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static int __init wakelocks_init(void)
 {
 	int ret;
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++)
+	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++) {
 		INIT_LIST_HEAD(&active_wake_locks[i]);
+		timerqueue_init_head(&active_timeouts[i]);
+	}
 
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_lock_init(&deleted_wake_locks, WAKE_LOCK_SUSPEND,
@@ -571,6 +671,7 @@ static int __init wakelocks_init(void)
 
 #ifdef CONFIG_WAKELOCK_STAT
 	proc_create("wakelocks", S_IRUGO, NULL, &wakelock_stats_fops);
+	proc_create("wakelocks_bin", S_IRUGO, NULL, &wakelock_stats_bin_fops);
 #endif
 
 	return 0;
@@ -591,6 +692,7 @@ err_platform_device_register:
 static void  __exit wakelocks_exit(void)
 {
 #ifdef CONFIG_WAKELOCK_STAT
+	remove_proc_entry("wakelocks_bin", NULL);
 	remove_proc_entry("wakelocks", NULL);
 #endif
 	destroy_workqueue(suspend_work_queue);
@@ -759,3 +759,52 @@ void pagefault_out_of_memory(void)
 	if (!test_thread_flag(TIF_MEMDIE))
 		schedule_timeout_uninterruptible(1);
 }
+
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+struct hlist_head oom_adj_index[OOM_ADJ_BUCKETS];
+
+/* Nests inside tasklist_lock and siglock; take nothing else under it */
+static DEFINE_SPINLOCK(oom_adj_index_lock);
+
+/* Called with tasklist_lock held for writing */
+void oom_adj_index_add(struct task_struct *p)
+{
+	spin_lock(&oom_adj_index_lock);
+	hlist_add_head_rcu(&p->oom_adj_node,
+			   oom_adj_bucket(p->signal->oom_adj));
+	spin_unlock(&oom_adj_index_lock);
+}
+
+/* Called with tasklist_lock held for writing */
+void oom_adj_index_del(struct task_struct *p)
+{
+	spin_lock(&oom_adj_index_lock);
+	hlist_del_init_rcu(&p->oom_adj_node);
+	spin_unlock(&oom_adj_index_lock);
+}
+
+/* A thread took over its group's leadership in exec */
+void oom_adj_index_replace(struct task_struct *old, struct task_struct *new)
+{
+	spin_lock(&oom_adj_index_lock);
+	hlist_del_init_rcu(&old->oom_adj_node);
+	hlist_add_head_rcu(&new->oom_adj_node,
+			   oom_adj_bucket(new->signal->oom_adj));
+	spin_unlock(&oom_adj_index_lock);
+}
+
+/* Move p's thread group to the bucket of its current oom_adj */
+void oom_adj_index_update(struct task_struct *p)
+{
+	read_lock(&tasklist_lock);
+	p = p->group_leader;
+	spin_lock(&oom_adj_index_lock);
+	if (!hlist_unhashed(&p->oom_adj_node)) {
+		hlist_del_rcu(&p->oom_adj_node);
+		hlist_add_head_rcu(&p->oom_adj_node,
+				   oom_adj_bucket(p->signal->oom_adj));
+	}
+	spin_unlock(&oom_adj_index_lock);
+	read_unlock(&tasklist_lock);
+}
+#endif
@@ -51,6 +51,8 @@
 #include <linux/kmemleak.h>
 #include <linux/memory.h>
 #include <linux/compaction.h>
+#include <linux/migrate.h>
+#include <linux/mm_inline.h>
 #include <trace/events/kmem.h>
 #include <linux/ftrace_event.h>
 
@@ -821,7 +823,11 @@ struct page *__rmqueue_smallest(struct zone *zone, unsigned int order,
 static int fallbacks[MIGRATE_TYPES][MIGRATE_TYPES-1] = {
 	[MIGRATE_UNMOVABLE]   = { MIGRATE_RECLAIMABLE, MIGRATE_MOVABLE,   MIGRATE_RESERVE },
 	[MIGRATE_RECLAIMABLE] = { MIGRATE_UNMOVABLE,   MIGRATE_MOVABLE,   MIGRATE_RESERVE },
+#ifdef CONFIG_CONTIG_LEND
+	[MIGRATE_MOVABLE]     = { MIGRATE_LENT,        MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE, MIGRATE_RESERVE },
+#else
 	[MIGRATE_MOVABLE]     = { MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE, MIGRATE_RESERVE },
+#endif
 	[MIGRATE_RESERVE]     = { MIGRATE_RESERVE,     MIGRATE_RESERVE,   MIGRATE_RESERVE }, /* Never used */
 };
 
@@ -937,11 +943,13 @@ __rmqueue_fallback(struct zone *zone, int order, int start_migratetype)
 			 * If breaking a large block of pages, move all free
 			 * pages to the preferred allocation list. If falling
 			 * back for a reclaimable kernel allocation, be more
-			 * agressive about taking ownership of free pages
+			 * agressive about taking ownership of free pages.
+			 * Lent blocks are never taken over.
 			 */
-			if (unlikely(current_order >= (pageblock_order >> 1)) ||
+			if (!is_migrate_lent(migratetype) &&
+			    (unlikely(current_order >= (pageblock_order >> 1)) ||
 					start_migratetype == MIGRATE_RECLAIMABLE ||
-					page_group_by_mobility_disabled) {
+					page_group_by_mobility_disabled)) {
 				unsigned long pages;
 				pages = move_freepages_block(zone, page,
 								start_migratetype);
@@ -960,7 +968,8 @@ __rmqueue_fallback(struct zone *zone, int order, int start_migratetype)
 			rmv_page_order(page);
 
 			/* Take ownership for orders >= pageblock_order */
-			if (current_order >= pageblock_order)
+			if (current_order >= pageblock_order &&
+			    !is_migrate_lent(migratetype))
 				change_pageblock_range(page, current_order,
 							start_migratetype);
 
@@ -1036,7 +1045,11 @@ static int rmqueue_bulk(struct zone *zone, unsigned int order,
 			list_add(&page->lru, list);
 		else
 			list_add_tail(&page->lru, list);
-		set_page_private(page, migratetype);
+		/* Pages of lent blocks must go back to the lent free lists */
+		if (is_migrate_lent(get_pageblock_migratetype(page)))
+			set_page_private(page, get_pageblock_migratetype(page));
+		else
+			set_page_private(page, migratetype);
 		list = &page->lru;
 	}
 	__mod_zone_page_state(zone, NR_FREE_PAGES, -(i << order));
@@ -5384,7 +5397,8 @@ __count_immobile_pages(struct zone *zone, struct page *page, int count)
 	if (zone_idx(zone) == ZONE_MOVABLE)
 		return true;
 
-	if (get_pageblock_migratetype(page) == MIGRATE_MOVABLE)
+	if (get_pageblock_migratetype(page) == MIGRATE_MOVABLE ||
+	    is_migrate_lent(get_pageblock_migratetype(page)))
 		return true;
 
 	pfn = page_to_pfn(page);
@@ -5499,7 +5513,7 @@ out:
 	spin_unlock_irqrestore(&zone->lock, flags);
 }
 
-#ifdef CONFIG_MEMORY_HOTREMOVE
+#if defined(CONFIG_MEMORY_HOTREMOVE) || defined(CONFIG_CONTIG_LEND)
 /*
  * All pages in the range must be isolated before calling this.
  */
@@ -5546,6 +5560,119 @@ __offline_isolated_pages(unsigned long start_pfn, unsigned long end_pfn)
 }
 #endif
 
+#ifdef CONFIG_CONTIG_LEND
+void lend_contig_range(unsigned long start_pfn, unsigned long end_pfn)
+{
+	unsigned long pfn;
+	struct page *page;
+	int i;
+
+	BUG_ON(start_pfn & (pageblock_nr_pages - 1));
+	BUG_ON(end_pfn & (pageblock_nr_pages - 1));
+
+	for (pfn = start_pfn; pfn < end_pfn; pfn += pageblock_nr_pages) {
+		page = pfn_to_page(pfn);
+		for (i = 0; i < pageblock_nr_pages; i++) {
+			__ClearPageReserved(page + i);
+			set_page_count(page + i, 0);
+		}
+		set_pageblock_migratetype(page, MIGRATE_LENT);
+		set_page_refcounted(page);
+		__free_pages(page, pageblock_order);
+	}
+	totalram_pages += end_pfn - start_pfn;
+}
+
+/* Turn isolated (or partly isolated) blocks of the range back into lent ones */
+static void relend_contig_range(unsigned long start_pfn, unsigned long end_pfn)
+{
+	unsigned long pfn, flags;
+	struct page *page;
+	struct zone *zone;
+
+	for (pfn = start_pfn; pfn < end_pfn; pfn += pageblock_nr_pages) {
+		page = pfn_to_page(pfn);
+		zone = page_zone(page);
+		spin_lock_irqsave(&zone->lock, flags);
+		set_pageblock_migratetype(page, MIGRATE_LENT);
+		move_freepages_block(zone, page, MIGRATE_LENT);
+		spin_unlock_irqrestore(&zone->lock, flags);
+	}
+}
+
+static struct page *
+lent_migrate_alloc(struct page *page, unsigned long private, int **result)
+{
+	return alloc_page(GFP_HIGHUSER_MOVABLE);
+}
+
+/*
+ * Migrate the pages in use in an isolated range. Returns 0 if there was
+ * nothing left to move, non-zero if some pages could not be moved (yet).
+ */
+static int migrate_lent_range(unsigned long start_pfn, unsigned long end_pfn)
+{
+	unsigned long pfn;
+	struct page *page;
+	int not_managed = 0;
+	int ret = 0;
+	LIST_HEAD(source);
+
+	for (pfn = start_pfn; pfn < end_pfn; pfn++) {
+		page = pfn_to_page(pfn);
+		if (!page_count(page))
+			continue;
+		if (!isolate_lru_page(page)) {
+			list_add_tail(&page->lru, &source);
+			inc_zone_page_state(page, NR_ISOLATED_ANON +
+					    page_is_file_cache(page));
+		} else if (page_count(page)) {
+			not_managed++;
+		}
+	}
+
+	if (!list_empty(&source)) {
+		/* this function returns # of failed pages */
+		ret = migrate_pages(&source, lent_migrate_alloc, 0, true, true);
+		if (ret)
+			putback_lru_pages(&source);
+	}
+
+	return ret ? ret : not_managed;
+}
+
+int reclaim_contig_range(unsigned long start_pfn, unsigned long end_pfn)
+{
+	int retry;
+	int ret;
+
+	ret = start_isolate_page_range(start_pfn, end_pfn);
+	if (ret)
+		goto failed;
+
+	lru_add_drain_all();
+	for (retry = 0; retry < 5; retry++) {
+		if (migrate_lent_range(start_pfn, end_pfn))
+			lru_add_drain_all();
+		drain_all_pages();
+		ret = test_pages_isolated(start_pfn, end_pfn);
+		if (!ret)
+			break;
+		yield();
+	}
+	if (ret)
+		goto failed;
+
+	__offline_isolated_pages(start_pfn, end_pfn);
+	totalram_pages -= end_pfn - start_pfn;
+	return 0;
+
+failed:
+	relend_contig_range(start_pfn, end_pfn);
+	return ret;
+}
+#endif
+
 #ifdef CONFIG_MEMORY_FAILURE
 bool is_free_buddy_page(struct page *page)
 {
@@ -606,6 +606,9 @@ static char * const migratetype_names[MIGRATE_TYPES] = {
 	"Movable",
 	"Reserve",
 	"Isolate",
+#ifdef CONFIG_CONTIG_LEND
+	"Lent",
+#endif
 };
 
 static void *frag_start(struct seq_file *m, loff_t *pos)